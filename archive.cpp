@@ -0,0 +1,301 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <thread>
+#include "main.h"
+#include "memory_budget.h"
+#include "path_table.h"
+#include "qic.h"
+#include "thread_pool.h"
+
+int read_archive_catalog(const MappedFile *file, ThreadPool *pool, Catalog &catalog) {
+    auto vtbl = file->get<qic_vtbl_t>(0);
+    if (!vtbl) {
+        fprintf(stderr, "%sCould not read vtbl\n", t_log_prefix);
+        return -3;
+    }
+
+    auto mdid = get_mdid(file, sizeof(qic_vtbl_t));
+    if (mdid.empty()) {
+        fprintf(stderr, "%sCould not read mdid\n", t_log_prefix);
+        return -4;
+    }
+
+    auto i = vtbl->dir_size / SEG_SZ;
+    if (vtbl->dir_size % SEG_SZ) {
+        i++;
+    }
+    auto dir_offset = file->size() - i * SEG_SZ;
+
+    std::vector<uint8_t> dir_buffer;
+    if (!read_catalog(file, dir_offset, vtbl->dir_size, dir_buffer)) {
+        fprintf(stderr, "%sCould not read catalog\n", t_log_prefix);
+        return -5;
+    }
+
+    auto dir_data = SafeArray::create(dir_buffer);
+    if (!read_dir_entries(dir_data.get(), catalog, pool)) {
+        fprintf(stderr, "%sCould not parse dir entries", t_log_prefix);
+        return -6;
+    }
+
+    reconstruct_tree(catalog);
+    return 0;
+}
+
+void recover_archive(const std::string &path, const MappedFile *file, const PathTable &paths, ThreadPool *pool,
+                     ThreadPool *writers, bool use_uring, bool use_index, const std::string &root, bool verbose,
+                     recovery_stats_t &stats) {
+    // A valid index spares walking the segment headers and scanning the data for file records.
+    auto index_path = path + ".idx";
+    archive_index_t index;
+    auto have_index = use_index && load_index(index_path, file, index) && index.data_offset == DATA_OFFSET;
+
+    std::vector<uint8_t> file_buffer;
+    std::vector<size_t> signatures;
+    bool data_ok;
+    if (have_index) {
+        data_ok = decode_segments(file, index.segments, file_buffer, pool) && index.complete;
+    } else {
+        index.data_offset = DATA_OFFSET;
+        data_ok = read_data_segment(file, DATA_OFFSET, file_buffer, pool, &index.segments, &signatures);
+    }
+
+    if (!data_ok) {
+        fprintf(stderr, "%sCould not read data segment\n", t_log_prefix);
+        // return -7;
+    }
+
+    auto file_data = SafeArray::create(file_buffer);
+    std::vector<recovered_file_entry_t> recovered_files;
+    if (have_index) {
+        if (verbose) {
+            printf("Loaded %zu file records from %s\n", index.files.size(), index_path.c_str());
+        }
+        recovered_files = index.files;
+    } else {
+        recover_files(file_data.get(), recovered_files, pool, &signatures);
+
+        index.complete = data_ok;
+        index.files = recovered_files;
+        if (use_index && !save_index(index_path, file, index)) {
+            fprintf(stderr, "%sCould not write index %s\n", t_log_prefix, index_path.c_str());
+        }
+    }
+
+    std::vector<recovered_file_entry_t> extracted_files;
+    for (const auto &file : recovered_files) {
+        if (verbose) {
+            printf("%s gs=%d size=%zu offset=%#zx\n", file.path.c_str(), file.has_guessed_size, file.guessed_size,
+                   file.offset);
+        }
+        stats.total_size += file.guessed_size;
+
+        auto node = paths.find(file.path);
+        if (node == Catalog::NO_NODE) {
+            fprintf(stderr, "%sCould not find %s in directory catalog\n", t_log_prefix, file.path.c_str());
+            ++stats.error_count;
+            continue;
+        }
+
+        auto final_entry = file;
+        final_entry.catalog_node = node;
+        reconcile_with_catalog(paths.catalog(), node, final_entry, stats.error_count);
+        extracted_files.push_back(final_entry);
+    }
+
+    // Files in raw segments are copied from the archive instead of the buffer.
+    raw_source_t raw = {file, &index.segments};
+    stats.error_count +=
+        extract_files(file_data.get(), extracted_files, &paths.catalog(), writers, use_uring, &raw, root);
+    stats.recovered_count = recovered_files.size();
+}
+
+int get_file_count(const Catalog &catalog) {
+    auto file_count = 0;
+    for (uint32_t node = 0; node < catalog.size(); ++node) {
+        if (!catalog.is_dir(node)) {
+            file_count++;
+        }
+    }
+    return file_count;
+}
+
+// Outcome of one archive of a batch.
+struct batch_result_t {
+    int status = 0;
+    int file_count = 0;
+    recovery_stats_t stats;
+};
+
+bool find_archives(const std::vector<std::string> &inputs, std::vector<std::string> &archives) {
+    for (const auto &input : inputs) {
+        std::error_code ec;
+        if (!fs::is_directory(input, ec)) {
+            archives.push_back(input);
+            continue;
+        }
+
+        std::vector<std::string> found;
+        for (const auto &entry : fs::directory_iterator(input, ec)) {
+            auto extension = entry.path().extension().string();
+            if (entry.is_regular_file(ec) && !strcasecmp(extension.c_str(), ".qic")) {
+                found.push_back(entry.path().string());
+            }
+        }
+
+        if (ec) {
+            fprintf(stderr, "Could not read directory %s\n", input.c_str());
+            return false;
+        }
+
+        std::sort(found.begin(), found.end());
+        archives.insert(archives.end(), found.begin(), found.end());
+    }
+
+    return true;
+}
+
+std::vector<std::string> get_output_roots(const std::string &output, const std::vector<std::string> &archives) {
+    std::vector<std::string> roots;
+    std::set<std::string> used;
+    for (const auto &archive : archives) {
+        auto name = fs::path(archive).stem().string();
+        auto root = name;
+        for (auto i = 2; !used.insert(root).second; ++i) {
+            root = name + "-" + std::to_string(i);
+        }
+        roots.push_back((fs::path(output) / root).string());
+    }
+    return roots;
+}
+
+// Memory that recovering an archive in memory takes: its decoded data region, plus its catalog, raw and parsed.
+static uint64_t get_memory_estimate(const MappedFile *file) {
+    auto vtbl = file->get<qic_vtbl_t>(0);
+    if (!vtbl) {
+        return 0;
+    }
+    return std::max<uint64_t>(vtbl->data_size, file->size()) + 2 * (uint64_t) vtbl->dir_size;
+}
+
+static void recover_batch_archive(const std::string &path, const std::string &root, ThreadPool *pool,
+                                  ThreadPool *writers, bool use_uring, bool use_index, MemoryBudget &budget,
+                                  batch_result_t &result) {
+    auto file = MappedFile::create(path);
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path.c_str());
+        result.status = -2;
+        return;
+    }
+
+    auto memory = get_memory_estimate(file.get());
+    budget.acquire(memory);
+
+    Catalog catalog;
+    result.status = read_archive_catalog(file.get(), pool, catalog);
+    if (result.status == 0) {
+        PathTable paths(catalog);
+        result.file_count = get_file_count(catalog);
+        recover_archive(path, file.get(), paths, pool, writers, use_uring, use_index, root, false, result.stats);
+        update_times_for_dirs(paths, writers, root);
+    }
+
+    budget.release(memory);
+}
+
+static void print_batch_summary(const std::vector<std::string> &archives, const std::vector<batch_result_t> &results) {
+    int width = strlen("archive");
+    for (const auto &archive : archives) {
+        width = std::max<int>(width, archive.size());
+    }
+
+    printf("%-*s %6s %8s %10s %7s %12s\n", width, "archive", "status", "files", "recovered", "errors", "size");
+    batch_result_t total;
+    for (size_t i = 0; i < archives.size(); ++i) {
+        const auto &result = results[i];
+        printf("%-*s %6s %8d %10zu %7d %12zu\n", width, archives[i].c_str(), result.status ? "failed" : "ok",
+               result.file_count, result.stats.recovered_count, result.stats.error_count, result.stats.total_size);
+        total.status |= result.status;
+        total.file_count += result.file_count;
+        total.stats.recovered_count += result.stats.recovered_count;
+        total.stats.error_count += result.stats.error_count;
+        total.stats.total_size += result.stats.total_size;
+    }
+
+    printf("%-*s %6s %8d %10zu %7d %12zu\n", width, "total", total.status ? "failed" : "ok", total.file_count,
+           total.stats.recovered_count, total.stats.error_count, total.stats.total_size);
+}
+
+int run_batch(const std::vector<std::string> &inputs, const std::string &output, ThreadPool *pool,
+              ThreadPool *writers, bool use_uring, bool use_index, uint64_t memory_limit) {
+    std::vector<std::string> archives;
+    if (!find_archives(inputs, archives)) {
+        return -2;
+    }
+
+    if (archives.empty()) {
+        fprintf(stderr, "No archives found\n");
+        return -2;
+    }
+
+    auto roots = get_output_roots(output, archives);
+    // The diagnostics of each archive name it, as those of different archives interleave.
+    std::vector<std::string> log_prefixes;
+    for (const auto &archive : archives) {
+        log_prefixes.push_back(archive + ": ");
+    }
+
+    std::vector<batch_result_t> results(archives.size());
+    MemoryBudget budget(memory_limit);
+    std::atomic<size_t> next(0);
+
+    std::vector<std::thread> drivers;
+    auto driver_count = std::min<size_t>(archives.size(), pool->size());
+    for (size_t i = 0; i < driver_count; ++i) {
+        drivers.emplace_back([&] {
+            for (size_t index; (index = next++) < archives.size();) {
+                t_log_prefix = log_prefixes[index].c_str();
+                recover_batch_archive(archives[index], roots[index], pool, writers, use_uring, use_index, budget,
+                                      results[index]);
+            }
+            t_log_prefix = "";
+        });
+    }
+
+    for (auto &driver : drivers) {
+        driver.join();
+    }
+
+    print_batch_summary(archives, results);
+    for (const auto &result : results) {
+        if (result.status) {
+            return -11;
+        }
+    }
+    return 0;
+}
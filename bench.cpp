@@ -0,0 +1,332 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+
+#include <chrono>
+#include <stdio.h>
+#include "main.h"
+#include "path_table.h"
+#include "test_utils.h"
+#include "thread_pool.h"
+
+template <typename F> static double measure_seconds(F func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void report(const char *name, size_t bytes, double seconds) {
+    printf("%-32s %8.1f MB/s\n", name, bytes / seconds / (1024 * 1024));
+}
+
+static void bench_decompress(const char *name, const std::vector<uint8_t> &data) {
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    std::vector<std::vector<uint8_t>> segments;
+    for (size_t i = 0; i < data.size(); i += CHUNK_SIZE) {
+        segments.push_back(test_compress(&data[i], std::min(CHUNK_SIZE, data.size() - i)));
+    }
+
+    std::vector<uint8_t> expected, actual;
+    expected.reserve(data.size());
+    actual.reserve(data.size());
+
+    auto ref = measure_seconds([&] {
+        for (auto &seg : segments) {
+            reference_decompress(seg.data(), seg.size(), expected);
+        }
+    });
+
+    auto cur = measure_seconds([&] {
+        for (auto &seg : segments) {
+            auto array = SafeArray::create(seg);
+            decompress(array.get(), actual);
+        }
+    });
+
+    if (actual != data || expected != data) {
+        fprintf(stderr, "%s: output mismatch\n", name);
+        exit(-1);
+    }
+
+    std::string label = name;
+    report((label + " (bit-serial)").c_str(), data.size(), ref);
+    report(label.c_str(), data.size(), cur);
+}
+
+static void bench_read_data_segment() {
+    auto data = make_sample_data(64 * 1024 * 1024, 6);
+    auto file = map_temp_file(make_data_region(data, 32 * 1024));
+
+    std::vector<uint8_t> buffer;
+    auto seconds = measure_seconds([&] { read_data_segment(file.get(), 0, buffer); });
+    if (buffer != data) {
+        fprintf(stderr, "read_data_segment: output mismatch\n");
+        exit(-1);
+    }
+
+    report("read_data_segment", data.size(), seconds);
+
+    auto pool = ThreadPool::create(0);
+    std::vector<uint8_t> parallel;
+    seconds = measure_seconds([&] { read_data_segment(file.get(), 0, parallel, pool.get()); });
+    if (parallel != data) {
+        fprintf(stderr, "read_data_segment: parallel output mismatch\n");
+        exit(-1);
+    }
+
+    std::string label = "read_data_segment -j" + std::to_string(pool->size());
+    report(label.c_str(), data.size(), seconds);
+}
+
+static void bench_find_signatures() {
+    auto data = make_data_stream(make_test_tree());
+    while (data.size() < 64 * 1024 * 1024) {
+        data.insert(data.end(), data.begin(), data.end());
+    }
+
+    uint32_t dat_sig = DAT_SIG;
+    std::vector<size_t> expected;
+    auto seconds = measure_seconds(
+        [&] { expected = reference_search(data.data(), data.size(), (uint8_t *) &dat_sig, sizeof(dat_sig)); });
+    report("search DAT_SIG (boyer-moore)", data.size(), seconds);
+
+    static const char *LEVEL_NAMES[] = {"scalar", "sse2", "avx2"};
+    for (auto level = SIMD_SCALAR; level <= get_simd_level(); level = simd_level_t(level + 1)) {
+        std::vector<signature_hit_t> hits;
+        seconds = measure_seconds([&] { find_signatures(data.data(), data.size(), 1 << SIG_DAT, hits, level); });
+        if (hits.size() != expected.size()) {
+            fprintf(stderr, "find_signatures: result mismatch\n");
+            exit(-1);
+        }
+
+        std::string label = std::string("find_signatures DAT ") + LEVEL_NAMES[level];
+        report(label.c_str(), data.size(), seconds);
+
+        hits.clear();
+        unsigned all = (1 << SIG_COUNT) - 1;
+        seconds = measure_seconds([&] { find_signatures(data.data(), data.size(), all, hits, level); });
+        label = std::string("find_signatures all ") + LEVEL_NAMES[level];
+        report(label.c_str(), data.size(), seconds);
+    }
+}
+
+static void bench_recover_files() {
+    auto data = make_data_stream(make_test_tree());
+    while (data.size() < 64 * 1024 * 1024) {
+        data.insert(data.end(), data.begin(), data.end());
+    }
+
+    // Carved images hold many false positives.
+    uint32_t dat_sig = DAT_SIG;
+    for (size_t offset = 1; offset + 256 * 1024 < data.size(); offset += 509) {
+        memcpy(&data[offset], &dat_sig, sizeof(dat_sig));
+    }
+
+    auto array = SafeArray::create(data);
+    std::vector<recovered_file_entry_t> serial, parallel;
+    auto seconds = measure_seconds([&] { recover_files(array.get(), serial); });
+    report("recover_files", data.size(), seconds);
+
+    auto pool = ThreadPool::create(0);
+    seconds = measure_seconds([&] { recover_files(array.get(), parallel, pool.get()); });
+    if (parallel.size() != serial.size()) {
+        fprintf(stderr, "recover_files: result mismatch\n");
+        exit(-1);
+    }
+
+    std::string label = "recover_files -j" + std::to_string(pool->size());
+    report(label.c_str(), data.size(), seconds);
+}
+
+static void bench_decode_and_scan() {
+    auto data = make_data_stream(make_test_tree());
+    while (data.size() < 64 * 1024 * 1024) {
+        data.insert(data.end(), data.begin(), data.end());
+    }
+    auto file = map_temp_file(make_data_region(data, 32 * 1024));
+
+    std::vector<uint8_t> buffer;
+    std::vector<recovered_file_entry_t> files;
+    auto seconds = measure_seconds([&] {
+        read_data_segment(file.get(), 0, buffer);
+        auto array = SafeArray::create(buffer);
+        recover_files(array.get(), files);
+    });
+    report("decode, then scan", data.size(), seconds);
+
+    std::vector<uint8_t> fused_buffer;
+    std::vector<recovered_file_entry_t> fused_files;
+    seconds = measure_seconds([&] {
+        std::vector<size_t> signatures;
+        read_data_segment(file.get(), 0, fused_buffer, nullptr, nullptr, &signatures);
+        auto array = SafeArray::create(fused_buffer);
+        recover_files(array.get(), fused_files, nullptr, &signatures);
+    });
+    if (fused_files.size() != files.size()) {
+        fprintf(stderr, "decode and scan: result mismatch\n");
+        exit(-1);
+    }
+
+    report("decode and scan fused", data.size(), seconds);
+}
+
+static void bench_read_dir_entries() {
+    // Hundreds of thousands of entries with names of typical length.
+    test_entry_t root{u"", true, {}, 900000000, {}};
+    for (auto d = 0; d < 1000; ++d) {
+        test_entry_t dir{u"DIRECTORY" + std::u16string(1, u'A' + d % 26), true, {}, 900000000, {}};
+        for (auto f = 0; f < 300; ++f) {
+            dir.children.push_back({u"some file name " + std::u16string(1, u'a' + f % 26) + u".txt", false, {},
+                                    900000000, {}});
+        }
+        root.children.push_back(dir);
+    }
+    auto catalog = make_catalog(root);
+    auto buffer = SafeArray::create(catalog);
+
+    Catalog entries;
+    auto seconds = measure_seconds([&] { read_dir_entries(buffer.get(), entries); });
+    report("read_dir_entries", catalog.size(), seconds);
+
+    auto pool = ThreadPool::create(0);
+    Catalog parallel_entries;
+    seconds = measure_seconds([&] { read_dir_entries(buffer.get(), parallel_entries, pool.get()); });
+    report("read_dir_entries (parallel)", catalog.size(), seconds);
+
+    seconds = measure_seconds([&] {
+        for (auto i = 0; i < 10; ++i) {
+            reconstruct_tree(entries);
+        }
+    });
+    printf("%-32s %8.1f ms\n", "reconstruct_tree", seconds * 100);
+
+    // Resolving the path of every file, as recovered from the data region.
+    std::vector<std::string> paths;
+    for (uint32_t node = 0; node < entries.size(); ++node) {
+        if (!entries.is_dir(node)) {
+            paths.push_back(entries.get_recursive_path(node));
+        }
+    }
+
+    size_t found = 0;
+    seconds = measure_seconds([&] {
+        std::unordered_map<std::string, uint32_t> by_path;
+        for (uint32_t node = 0; node < entries.size(); ++node) {
+            by_path[entries.get_recursive_path(node)] = node;
+        }
+        for (const auto &path : paths) {
+            found += by_path.count(path);
+        }
+    });
+    printf("%-32s %8.1f ms\n", "catalog lookup (path map)", seconds * 1000);
+
+    seconds = measure_seconds([&] {
+        PathTable table(entries);
+        for (const auto &path : paths) {
+            found -= table.find(path) != Catalog::NO_NODE;
+        }
+    });
+    if (found != 0) {
+        fprintf(stderr, "PathTable: result mismatch\n");
+        exit(-1);
+    }
+    printf("%-32s %8.1f ms\n", "catalog lookup (path table)", seconds * 1000);
+}
+
+static void bench_utf16_to_utf8() {
+    // Short names, mostly ASCII like those of Windows 98 backups.
+    std::vector<std::u16string> names;
+    size_t total_size = 0;
+    for (auto i = 0; i < 1000000; ++i) {
+        names.push_back(u"Program Files " + std::u16string(i % 20, u'a' + i % 26) + (i % 50 ? u".txt" : u"\u00e9"));
+        total_size += names.back().size() * 2;
+    }
+
+    size_t size = 0;
+    auto seconds = measure_seconds([&] {
+        for (const auto &name : names) {
+            size += reference_utf16_to_utf8(name.data(), name.size() * 2).size();
+        }
+    });
+    report("utf16_to_utf8 (wstring_convert)", total_size, seconds);
+
+    std::vector<char> out(64 * 3);
+    size_t fast_size = 0;
+    seconds = measure_seconds([&] {
+        for (const auto &name : names) {
+            fast_size += utf16_to_utf8(name.data(), name.size() * 2, out.data());
+        }
+    });
+    if (fast_size != size) {
+        fprintf(stderr, "utf16_to_utf8: result mismatch\n");
+        exit(-1);
+    }
+    report("utf16_to_utf8", total_size, seconds);
+}
+
+static void bench_get_time() {
+    // Times of files from the nineties and later.
+    std::vector<unsigned long> dates(1000000);
+    std::mt19937 rng(13);
+    std::generate(dates.begin(), dates.end(), [&] { return 600000000 + rng() % 1000000000; });
+
+    time_t ref = 0, cur = 0;
+    auto ref_seconds = measure_seconds([&] {
+        for (auto date : dates) {
+            ref += reference_get_time(date);
+        }
+    });
+    auto seconds = measure_seconds([&] {
+        for (auto date : dates) {
+            cur += get_time(date);
+        }
+    });
+
+    if (ref != cur) {
+        fprintf(stderr, "get_time: result mismatch\n");
+        exit(-1);
+    }
+    printf("%-32s %8.1f ns\n", "get_time (loop and mktime)", ref_seconds * 1e9 / dates.size());
+    printf("%-32s %8.1f ns\n", "get_time", seconds * 1e9 / dates.size());
+}
+
+int main(int argc, char **argv) {
+    bench_decompress("decompress mixed", make_sample_data(32 * 1024 * 1024, 1));
+    bench_decompress("decompress text", make_sample_data(16 * 1024 * 1024, 1, true));
+
+    // Incompressible input decodes to literals only and stresses the bit reader.
+    std::vector<uint8_t> noise(8 * 1024 * 1024);
+    std::mt19937 rng(2);
+    std::generate(noise.begin(), noise.end(), rng);
+    bench_decompress("decompress literals", noise);
+
+    bench_read_data_segment();
+    bench_find_signatures();
+    bench_recover_files();
+    bench_decode_and_scan();
+    bench_read_dir_entries();
+    bench_utf16_to_utf8();
+    bench_get_time();
+    return 0;
+}
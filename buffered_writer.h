@@ -0,0 +1,104 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#ifndef _BUFFERED_WRITER_H_
+#define _BUFFERED_WRITER_H_
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <unistd.h>
+
+// Collects output in a large buffer and writes it to a descriptor once the buffer is full, so that producing many
+// short lines takes few syscalls. Once a write fails, the rest of the output is dropped and flush() returns false.
+class BufferedWriter {
+    static constexpr size_t DEFAULT_SIZE = 1024 * 1024;
+
+    int m_fd;
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_size;
+    size_t m_pos = 0;
+    bool m_failed = false;
+
+    void write_all(const char *data, size_t size) {
+        for (size_t written = 0; written < size && !m_failed;) {
+            auto ret = ::write(m_fd, data + written, size - written);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            m_failed = ret <= 0;
+            written += ret;
+        }
+    }
+
+public:
+    BufferedWriter(int fd, size_t size = DEFAULT_SIZE) : m_fd(fd), m_buffer(new char[size]), m_size(size) {
+    }
+
+    BufferedWriter(const BufferedWriter &) = delete;
+    BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+    ~BufferedWriter() {
+        flush();
+    }
+
+    bool flush() {
+        write_all(m_buffer.get(), m_pos);
+        m_pos = 0;
+        return !m_failed;
+    }
+
+    void write(std::string_view data) {
+        if (m_size - m_pos < data.size()) {
+            flush();
+            if (data.size() >= m_size) {
+                // Too large to be buffered, written as it is.
+                write_all(data.data(), data.size());
+                return;
+            }
+        }
+
+        memcpy(m_buffer.get() + m_pos, data.data(), data.size());
+        m_pos += data.size();
+    }
+
+    void put(char c) {
+        if (m_pos == m_size) {
+            flush();
+        }
+        m_buffer[m_pos++] = c;
+    }
+
+    // Writes the number right-aligned in width characters.
+    void put_number(int64_t value, size_t width = 0) {
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        for (auto size = (size_t) (end - digits); size < width; ++size) {
+            put(' ');
+        }
+        write(std::string_view(digits, end - digits));
+    }
+};
+
+#endif
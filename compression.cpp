@@ -22,6 +22,7 @@
 
 #include <inttypes.h>
 
+#include <array>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
@@ -34,80 +35,174 @@
 #include "mapped_file.h"
 
 class BitStream {
-    const uint8_t *m_buffer;
-    size_t m_size;
+    const uint8_t *m_ptr;
+    const uint8_t *m_end;
 
-    // Keeps track of the current bit position.
-    size_t m_bit_pos;
+    // Upcoming bits of the stream, the next one being the most significant.
+    uint64_t m_bits;
+
+    // Number of valid bits in m_bits.
+    unsigned m_count;
+
+    static uint64_t load_be64(const uint8_t *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return __builtin_bswap64(v);
+    }
 
 public:
-    BitStream(const uint8_t *buffer, size_t buffer_size) : m_buffer(buffer), m_size(buffer_size), m_bit_pos(0) {
+    BitStream(const uint8_t *buffer, size_t buffer_size)
+        : m_ptr(buffer), m_end(buffer + buffer_size), m_bits(0), m_count(0) {
         if (!buffer) {
             throw std::invalid_argument("Buffer cannot be null");
         }
     }
 
-    bool get_next_bit(uint8_t *bit) {
-        if (m_bit_pos >= m_size * 8) {
-            return false; // No more bits available
+    // Tops up the bit buffer to at least 56 bits, unless the input runs out first.
+    void refill() {
+        if (m_end - m_ptr >= 8) {
+            // The bits loaded past m_count are the real upcoming bits, so reloading them later is harmless.
+            m_bits |= load_be64(m_ptr) >> m_count;
+            m_ptr += (63 - m_count) >> 3;
+            m_count |= 56;
+        } else {
+            while (m_count <= 56 && m_ptr < m_end) {
+                m_bits |= (uint64_t) *m_ptr++ << (56 - m_count);
+                m_count += 8;
+            }
         }
+    }
 
-        size_t byte_index = m_bit_pos / 8;
-        size_t bit_index = m_bit_pos % 8;
-
-        *bit = (m_buffer[byte_index] >> (7 - bit_index)) & 0x01;
-        ++m_bit_pos;
+    unsigned available() const {
+        return m_count;
+    }
 
-        return true;
+    // Returns the next count bits (1 to 32) without consuming them.
+    uint32_t peek(unsigned count) const {
+        return m_bits >> (64 - count);
     }
 
-    bool get_next_byte(uint8_t *byte) {
-        return get_next_bits<uint8_t>(byte, 8);
+    void consume(unsigned count) {
+        m_bits <<= count;
+        m_count -= count;
     }
 
-    template <typename T> bool get_next_bits(T *out, size_t count) {
+    template <typename T> bool get_next_bits(T *out, unsigned count) {
         if (count > sizeof(T) * 8) {
             return false;
         }
 
-        *out = 0;
-
-        for (int i = 0; i < count; ++i) {
-            uint8_t bit;
-            if (!get_next_bit(&bit)) {
-                return false; // Should not happen, but just in case
+        if (count > m_count) {
+            refill();
+            if (count > m_count) {
+                return false;
             }
-            *out = (*out << 1) | bit;
         }
 
+        *out = peek(count);
+        consume(count);
         return true;
     }
+};
 
-    static std::shared_ptr<BitStream> create(const uint8_t *buffer, size_t buffer_size) {
-        return std::make_shared<BitStream>(buffer, buffer_size);
-    }
+// Decoding of a match offset from the selector bit that follows the flag bit.
+struct offset_code_t {
+    uint8_t width;
+    // Bits up to the length field: flag, selector and offset.
+    uint8_t bits;
+};
+
+// Decoding of the two 2-bit length nibbles from the next four bits.
+struct length_code_t {
+    // Match length, or the base length when the 4-bit nibble tail follows.
+    uint8_t length;
+    uint8_t bits;
+    bool has_tail;
 };
 
+static constexpr std::array<offset_code_t, 2> make_offset_table() {
+    std::array<offset_code_t, 2> table = {};
+    for (unsigned selector = 0; selector < 2; ++selector) {
+        uint8_t width = selector ? 7 : 11;
+        table[selector] = {width, uint8_t(width + 2)};
+    }
+    return table;
+}
+
+static constexpr std::array<length_code_t, 16> make_length_table() {
+    std::array<length_code_t, 16> table = {};
+    for (unsigned code = 0; code < 16; ++code) {
+        unsigned first = code >> 2, second = code & 3;
+        if (first < 3) {
+            table[code] = {uint8_t(first + 2), 2, false};
+        } else if (second < 3) {
+            table[code] = {uint8_t(second + 5), 4, false};
+        } else {
+            table[code] = {6, 4, true};
+        }
+    }
+    return table;
+}
+
+static constexpr auto OFFSET_TABLE = make_offset_table();
+static constexpr auto LENGTH_TABLE = make_length_table();
+
+// Longest token the table path decodes without touching the bit buffer again.
+static const unsigned MAX_SHORT_TOKEN_BITS = 13 + 4;
+
 static bool get_offset(BitStream *stream, uint16_t *offset) {
-    uint8_t is_7bit;
-    if (!stream->get_next_bit(&is_7bit)) {
+    if (stream->available() < 12) {
+        stream->refill();
+        if (stream->available() < 1) {
+            return false;
+        }
+    }
+
+    unsigned width = OFFSET_TABLE[stream->peek(1)].width;
+    if (stream->available() < width + 1) {
         return false;
     }
 
-    if (is_7bit) {
-        return stream->get_next_bits(offset, 7);
-    } else {
-        return stream->get_next_bits(offset, 11);
+    *offset = stream->peek(width + 1) & ((1 << width) - 1);
+    stream->consume(width + 1);
+    return true;
+}
+
+// Long matches continue with 4-bit nibbles, 15 meaning that another one follows.
+static bool get_length_tail(BitStream *stream, uint32_t *length) {
+    while (true) {
+        uint8_t nibble;
+        if (!stream->get_next_bits(&nibble, 4)) {
+            return false;
+        }
+
+        if (nibble < 15) {
+            *length += nibble + 2;
+            return true;
+        } else {
+            *length += 15;
+        }
     }
+
+    return true;
 }
 
 static bool get_length(BitStream *stream, uint32_t *length) {
-    uint8_t nibble;
+    if (stream->available() < 4) {
+        stream->refill();
+    }
 
-    *length = 0;
+    if (stream->available() >= 4) {
+        const auto &code = LENGTH_TABLE[stream->peek(4)];
+        stream->consume(code.bits);
+        *length = code.length;
+        return !code.has_tail || get_length_tail(stream, length);
+    }
 
+    // Near the end of the input, the nibbles may not all be there.
+    *length = 0;
     for (auto i = 0; i < 2; i++) {
-        nibble = 0;
+        uint8_t nibble;
         if (!stream->get_next_bits(&nibble, 2)) {
             return false;
         }
@@ -120,31 +215,76 @@ static bool get_length(BitStream *stream, uint32_t *length) {
         }
     }
 
-    while (true) {
-        nibble = 0;
-        if (!stream->get_next_bits(&nibble, 4)) {
-            return false;
+    return get_length_tail(stream, length);
+}
+
+// Bytes that wide copies may write past the end of a match.
+static const size_t COPY_SLACK = 16;
+
+// Expands a match whose source lies entirely before dst. Writes up to COPY_SLACK bytes past dst + length.
+static void copy_match(uint8_t *dst, size_t offset, size_t length) {
+    const uint8_t *src = dst - offset;
+    auto end = dst + length;
+
+    if (offset >= 16) {
+        if (length > 16 && offset >= length) {
+            memcpy(dst, src, length);
+            return;
         }
 
-        if (nibble < 15) {
-            *length += nibble + 2;
-            return true;
-        } else {
-            *length += 15;
+        // Each 16-byte chunk only reads bytes written before it.
+        for (; dst < end; dst += 16, src += 16) {
+            memcpy(dst, src, 16);
+        }
+    } else if (offset == 1) {
+        memset(dst, *src, length);
+    } else {
+        // Replicate the period across a 16-byte pattern, then store it every whole number of periods.
+        uint8_t pattern[16];
+        for (size_t i = 0; i < 16; ++i) {
+            pattern[i] = i < offset ? src[i] : pattern[i - offset];
         }
-    }
 
-    return true;
+        auto step = 16 - 16 % offset;
+        for (; dst < end; dst += step) {
+            memcpy(dst, pattern, 16);
+        }
+    }
 }
 
+// Decodes straight into the output, matches being copied from the bytes already written. The output is
+// either a vector that grows as needed, or a fixed-size buffer that is never written past its end.
 class HistoryBuffer {
-    std::vector<uint8_t> m_history;
-    std::vector<uint8_t> &m_out;
-    size_t m_offset;
+    static const size_t GROW_SIZE = 64 * 1024;
+
+    // Set when the output can grow.
+    std::vector<uint8_t> *m_out;
+
+    // Output of this segment, and the end of the writable memory.
+    uint8_t *m_start;
+    uint8_t *m_pos;
+    uint8_t *m_end;
+
+    bool grow(size_t count) {
+        if (!m_out) {
+            return false;
+        }
+
+        auto start = m_start - m_out->data();
+        auto pos = m_pos - m_out->data();
+        m_out->resize(pos + count + COPY_SLACK + GROW_SIZE);
+        m_start = m_out->data() + start;
+        m_pos = m_out->data() + pos;
+        m_end = m_out->data() + m_out->size();
+        return true;
+    }
 
 public:
-    HistoryBuffer(std::vector<uint8_t> &out) : m_history(), m_out(out), m_offset(0) {
-        m_history.resize(2048);
+    HistoryBuffer(std::vector<uint8_t> &out) : m_out(&out) {
+        m_start = m_pos = m_end = out.data() + out.size();
+    }
+
+    HistoryBuffer(uint8_t *out, size_t size) : m_out(nullptr), m_start(out), m_pos(out), m_end(out + size) {
     }
 
     ~HistoryBuffer() {
@@ -152,81 +292,139 @@ public:
     }
 
     void flush() {
-        for (auto i = 0; i < m_offset; ++i) {
-            m_out.push_back(m_history[i]);
+        if (m_out) {
+            m_out->resize(m_pos - m_out->data());
         }
-        m_offset = 0;
     }
 
-    void put(uint8_t byte) {
-        if (m_offset == m_history.size()) {
-            flush();
+    size_t size() const {
+        return m_pos - m_start;
+    }
+
+    bool put(uint8_t byte) {
+        if (m_pos == m_end && !grow(1)) {
+            return false;
         }
-        m_history[m_offset++] = byte;
+        *m_pos++ = byte;
+        return true;
     }
 
-    void put(const size_t offset, size_t length) {
-        while (length-- > 0) {
-            if (m_offset == m_history.size()) {
-                flush();
+    bool put(const size_t offset, size_t length) {
+        size_t room = m_end - m_pos;
+        if (room < length + COPY_SLACK && !grow(length)) {
+            if (room < length) {
+                return false;
             }
+        } else if (offset <= size()) {
+            copy_match(m_pos, offset, length);
+            m_pos += length;
+            return true;
+        }
 
-            size_t index = 0;
-            if (m_offset >= offset) {
-                index = m_offset - offset;
-            } else {
-                index = m_offset + 2048 - offset;
-            }
-            m_history[m_offset++] = m_history[index % 2048];
+        // The history window starts zero-filled, a match may reach back into it at the start of a segment.
+        // This path also finishes a fixed-size output, where there is no room for the slack of wide copies.
+        auto pos = size();
+        for (size_t i = 0; i < length; ++i) {
+            m_pos[i] = pos + i >= offset ? m_pos[i - offset] : 0;
         }
+        m_pos += length;
+        return true;
     }
 };
 
-bool decompress(const SafeArray *in, std::vector<uint8_t> &out) {
-    HistoryBuffer history(out);
-
+static bool decompress(const SafeArray *in, HistoryBuffer &history) {
     auto buffer = in->get(0, in->size());
     if (!buffer) {
         return false;
     }
 
-    auto stream = BitStream::create(buffer, in->size());
-    if (!stream) {
-        return false;
-    }
+    BitStream stream(buffer, in->size());
 
     while (true) {
-        uint8_t byte;
-        uint8_t is_compressed;
-        if (!stream->get_next_bit(&is_compressed)) {
-            return false;
+        if (stream.available() < MAX_SHORT_TOKEN_BITS) {
+            stream.refill();
         }
 
-        if (is_compressed) {
-            uint16_t offset;
-            if (!get_offset(stream.get(), &offset)) {
-                return false;
+        if (stream.available() >= MAX_SHORT_TOKEN_BITS) {
+            // Decode the whole token from one peek, only long match lengths need more bits.
+            auto window = stream.peek(32);
+            if (!(window >> 31)) {
+                if (!history.put((uint8_t) (window >> 23))) {
+                    return false;
+                }
+                stream.consume(9);
+                continue;
             }
 
+            const auto &token = OFFSET_TABLE[(window >> 30) & 1];
+            uint16_t offset = (window << 2) >> (32 - token.width);
             if (offset == 0) {
                 // Finished decompressing.
                 return true;
             }
 
-            uint32_t length;
-            if (!get_length(stream.get(), &length)) {
+            const auto &code = LENGTH_TABLE[(window << token.bits) >> 28];
+            stream.consume(token.bits + code.bits);
+
+            uint32_t length = code.length;
+            if (code.has_tail && !get_length_tail(&stream, &length)) {
                 return false;
             }
 
-            history.put(offset, length);
-        } else {
-            if (!stream->get_next_byte(&byte)) {
+            if (!history.put(offset, length)) {
+                return false;
+            }
+            continue;
+        }
+
+        uint8_t is_compressed;
+        if (!stream.get_next_bits(&is_compressed, 1)) {
+            return false;
+        }
+
+        if (!is_compressed) {
+            uint8_t byte;
+            if (!stream.get_next_bits(&byte, 8)) {
+                return false;
+            }
+
+            if (!history.put(byte)) {
                 return false;
             }
+            continue;
+        }
 
-            history.put(byte);
+        uint16_t offset;
+        if (!get_offset(&stream, &offset)) {
+            return false;
+        }
+
+        if (offset == 0) {
+            // Finished decompressing.
+            return true;
+        }
+
+        uint32_t length;
+        if (!get_length(&stream, &length)) {
+            return false;
+        }
+
+        if (!history.put(offset, length)) {
+            return false;
         }
     }
 
     return true;
 }
+
+bool decompress(const SafeArray *in, std::vector<uint8_t> &out) {
+    HistoryBuffer history(out);
+    return decompress(in, history);
+}
+
+bool decompress(const SafeArray *in, uint8_t *out, size_t out_size, size_t *decompressed_size) {
+    HistoryBuffer history(out, out_size);
+    auto ret = decompress(in, history);
+    *decompressed_size = history.size();
+    return ret;
+}
@@ -20,10 +20,80 @@
 /// SOFTWARE.
 ///
 
+#include <algorithm>
+#include <cstring>
 #include "main.h"
 #include "qic.h"
+#include "thread_pool.h"
+
+// A compressed segment cannot decode to more than this many times its size.
+static const size_t MAX_EXPANSION = 32;
+
+// Reads the headers of the segment at offset. Returns false if they or the segment data lie past the end of the
+// file. The end of the data region is a segment of size 0.
+static bool read_segment_header(const MappedFile *file, size_t offset, segment_t &segment) {
+    auto seg_head = file->get<cseg_head_t>(offset);
+    if (!seg_head) {
+        return false;
+    }
+
+    offset += sizeof(cseg_head_t);
+
+    auto frame_head = file->get<cframe_head_t>(offset);
+    if (!frame_head) {
+        return false;
+    }
+
+    segment.compressed = (frame_head->segment_size & RAW_SEG) == 0;
+    segment.size = frame_head->segment_size & ~RAW_SEG;
+    segment.cumulative_size = seg_head->cumulative_size;
+    segment.offset = offset + sizeof(cframe_head_t);
+
+    return segment.size == 0 || file->get(segment.offset, segment.size);
+}
+
+bool read_segments(const MappedFile *file, size_t start_offset, std::vector<segment_t> &segments) {
+    while (true) {
+        segment_t segment;
+        if (!read_segment_header(file, start_offset, segment)) {
+            return false;
+        }
+
+        if (segment.size == 0) {
+            break;
+        }
+
+        segments.push_back(segment);
+        start_offset = segment.offset + segment.size;
+    }
+
+    return true;
+}
+
+// Returns the number of segments whose output position and size the headers plausibly describe,
+// starting from the first one.
+static size_t get_sized_segment_count(const std::vector<segment_t> &segments) {
+    uint64_t start = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        const auto &seg = segments[i];
+        if (seg.cumulative_size < start) {
+            return i;
+        }
+
+        auto size = seg.cumulative_size - start;
+        if (seg.compressed ? size > seg.size * MAX_EXPANSION : size != seg.size) {
+            return i;
+        }
+
+        start = seg.cumulative_size;
+    }
+
+    return segments.size();
+}
 
 bool read_catalog(const MappedFile *file, size_t start_offset, size_t size, std::vector<uint8_t> &buffer) {
+    buffer.reserve(buffer.size() + size);
+
     while (size > 0) {
         auto seg_head = file->get<cseg_head_t>(start_offset);
         if (!seg_head) {
@@ -33,10 +103,13 @@ bool read_catalog(const MappedFile *file, size_t start_offset, size_t size, std:
         start_offset += sizeof(cseg_head_t);
 
         auto frame_head = file->get<cframe_head_t>(start_offset);
+        if (!frame_head) {
+            return false;
+        }
 
         bool compressed = (frame_head->segment_size & RAW_SEG) == 0;
         if (compressed) {
-            fprintf(stderr, "Compression not supported\n");
+            fprintf(stderr, "%sCompression not supported\n", t_log_prefix);
             return false;
         }
 
@@ -48,9 +121,7 @@ bool read_catalog(const MappedFile *file, size_t start_offset, size_t size, std:
             return false;
         }
 
-        for (auto i = 0; i < segment_size; ++i) {
-            buffer.push_back(data[i]);
-        }
+        buffer.insert(buffer.end(), data, data + segment_size);
 
         start_offset += segment_size;
         size -= segment_size;
@@ -59,50 +130,225 @@ bool read_catalog(const MappedFile *file, size_t start_offset, size_t size, std:
     return true;
 }
 
-bool read_data_segment(const MappedFile *file, size_t start_offset, std::vector<uint8_t> &buffer) {
-    auto total_read = 0;
-    auto segments_read = 0;
+// Decodes a segment into its slot of the pre-sized output, returns false if it does not fill it exactly.
+static bool read_sized_segment(const MappedFile *file, const segment_t &seg, uint8_t *out, size_t out_size) {
+    auto data = file->get(seg.offset, seg.size);
 
-    while (true) {
-        auto seg_head = file->get<cseg_head_t>(start_offset);
-        if (!seg_head) {
+    if (!seg.compressed) {
+        memcpy(out, data, seg.size);
+        return true;
+    }
+
+    auto array = SafeArray::create(data, seg.size);
+    size_t decompressed_size;
+    return decompress(array.get(), out, out_size, &decompressed_size) && decompressed_size == out_size;
+}
+
+// Finds the signatures lying entirely within [start, end) of the output.
+static void find_segment_signatures(const uint8_t *data, size_t start, size_t end, std::vector<size_t> &signatures) {
+    std::vector<signature_hit_t> hits;
+    find_signatures(data + start, end - start, 1 << SIG_DAT, hits);
+    for (const auto &hit : hits) {
+        signatures.push_back(start + hit.offset);
+    }
+}
+
+bool decode_segments(const MappedFile *file, const std::vector<segment_t> &segments, std::vector<uint8_t> &buffer,
+                     ThreadPool *pool, std::vector<segment_t> *decoded, std::vector<size_t> *signatures) {
+    // Size the output once from the cumulative sizes in the segment headers and decode each segment in place.
+    // Segments are independent, so that can happen in parallel.
+    auto base = buffer.size();
+    auto sized_count = get_sized_segment_count(segments);
+    buffer.resize(base + (sized_count ? segments[sized_count - 1].cumulative_size : 0));
+
+    // Each segment is searched for signatures while its output is still in the cache, those straddling the end
+    // of a segment are looked for once all of them are decoded.
+    std::vector<std::vector<size_t>> segment_signatures(signatures ? segments.size() : 0);
+    std::vector<uint64_t> ends;
+
+    auto get_start = [&](size_t i) -> uint64_t { return i ? segments[i - 1].cumulative_size : 0; };
+    auto read_segment = [&](size_t i) {
+        auto start = get_start(i);
+        if (!read_sized_segment(file, segments[i], buffer.data() + base + start, segments[i].cumulative_size - start)) {
             return false;
         }
+        if (signatures && segments[i].cumulative_size - start >= sizeof(uint32_t)) {
+            find_segment_signatures(buffer.data() + base, start, segments[i].cumulative_size, segment_signatures[i]);
+        }
+        return true;
+    };
 
-        start_offset += sizeof(cseg_head_t);
+    size_t i = 0;
+    if (pool && pool->size() > 1) {
+        std::vector<uint8_t> ok(sized_count);
+        pool->parallel_for(sized_count, [&](size_t i) { ok[i] = read_segment(i); });
+        while (i < sized_count && ok[i]) {
+            ++i;
+        }
+    } else {
+        while (i < sized_count && read_segment(i)) {
+            ++i;
+        }
+    }
 
-        auto frame_head = file->get<cframe_head_t>(start_offset);
+    // Past the first segment the headers got wrong, the output is appended as it gets decoded.
+    buffer.resize(base + get_start(i));
+    if (decoded) {
+        decoded->assign(segments.begin(), segments.begin() + i);
+    }
+    for (size_t j = 0; j < i; ++j) {
+        ends.push_back(segments[j].cumulative_size);
+    }
 
-        bool compressed = (frame_head->segment_size & RAW_SEG) == 0;
-        auto segment_size = frame_head->segment_size & ~RAW_SEG;
-        if (segment_size == 0) {
-            break;
+    bool ok = true;
+    for (; i < segments.size() && ok; ++i) {
+        auto seg = segments[i];
+        auto data = file->get(seg.offset, seg.size);
+
+        if (seg.compressed) {
+            auto array = SafeArray::create(data, seg.size);
+            ok = decompress(array.get(), buffer);
+        } else {
+            buffer.insert(buffer.end(), data, data + seg.size);
         }
 
-        start_offset += sizeof(cframe_head_t);
-        auto data = file->get(start_offset, segment_size);
-        if (!data) {
-            return false;
+        // A segment that fails to decode is recorded with the partial output it produced.
+        auto start = ends.empty() ? 0 : ends.back();
+        ends.push_back(buffer.size() - base);
+        if (decoded) {
+            seg.cumulative_size = ends.back();
+            decoded->push_back(seg);
         }
 
-        if (compressed) {
-            auto array = SafeArray::create(data, segment_size);
-            if (!array) {
-                return false;
-            }
-            if (!decompress(array.get(), buffer)) {
-                fprintf(stderr, "decompression failed\n");
-                return false;
+        if (signatures) {
+            segment_signatures[i].clear();
+            if (ends.back() - start >= sizeof(uint32_t)) {
+                find_segment_signatures(buffer.data() + base, start, ends.back(), segment_signatures[i]);
             }
-        } else {
-            for (auto i = 0; i < segment_size; ++i) {
-                buffer.push_back(data[i]);
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%sdecompression failed\n", t_log_prefix);
+        }
+    }
+
+    if (signatures) {
+        // Offsets are relative to the start of the output of the first segment.
+        auto out = buffer.data() + base;
+        auto size = buffer.size() - base;
+        uint32_t dat_sig = DAT_SIG;
+        for (size_t j = 0; j < ends.size(); ++j) {
+            signatures->insert(signatures->end(), segment_signatures[j].begin(), segment_signatures[j].end());
+
+            auto start = j ? ends[j - 1] : 0;
+            auto from = std::max(start, ends[j] < sizeof(uint32_t) ? 0 : ends[j] - sizeof(uint32_t) + 1);
+            for (auto offset = from; offset < ends[j] && offset + sizeof(uint32_t) <= size; ++offset) {
+                if (!memcmp(out + offset, &dat_sig, sizeof(dat_sig))) {
+                    signatures->push_back(offset);
+                }
             }
         }
+    }
 
-        start_offset += segment_size;
-        total_read += segment_size;
-        ++segments_read;
+    return ok;
+}
+
+bool read_data_segment(const MappedFile *file, size_t start_offset, std::vector<uint8_t> &buffer, ThreadPool *pool,
+                       std::vector<segment_t> *decoded, std::vector<size_t> *signatures) {
+    std::vector<segment_t> segments;
+    auto complete = read_segments(file, start_offset, segments);
+    return decode_segments(file, segments, buffer, pool, decoded, signatures) && complete;
+}
+
+bool read_data_range(const MappedFile *file, const std::vector<segment_t> &segments, uint64_t offset, size_t size,
+                     std::vector<uint8_t> &buffer, ThreadPool *pool) {
+    if (size == 0) {
+        return true;
+    }
+
+    // Segments decode independently of each other, so only the ones covering the range are needed.
+    auto by_end = [](uint64_t offset, const segment_t &seg) { return offset < seg.cumulative_size; };
+    auto first = std::upper_bound(segments.begin(), segments.end(), offset, by_end);
+    auto last = std::upper_bound(first, segments.end(), offset + size - 1, by_end);
+    if (last == segments.end()) {
+        return false;
+    }
+
+    uint64_t base = first == segments.begin() ? 0 : std::prev(first)->cumulative_size;
+    std::vector<segment_t> covering(first, last + 1);
+    for (auto &seg : covering) {
+        seg.cumulative_size -= base;
+    }
+
+    // The last segment may have failed to decode when the index was built, its partial output is still good.
+    std::vector<uint8_t> data;
+    decode_segments(file, covering, data, pool);
+    if (data.size() < offset - base + size) {
+        return false;
+    }
+
+    auto start = data.begin() + (offset - base);
+    buffer.insert(buffer.end(), start, start + size);
+    return true;
+}
+
+bool get_raw_extents(const std::vector<segment_t> &segments, uint64_t offset, size_t size,
+                     std::vector<file_extent_t> &extents) {
+    extents.clear();
+    if (size == 0) {
+        return true;
+    }
+
+    auto by_end = [](uint64_t offset, const segment_t &seg) { return offset < seg.cumulative_size; };
+    auto it = std::upper_bound(segments.begin(), segments.end(), offset, by_end);
+    uint64_t start = it == segments.begin() ? 0 : std::prev(it)->cumulative_size;
+    auto end = offset + size;
+
+    for (; it != segments.end() && start < end; start = (it++)->cumulative_size) {
+        if (it->compressed || it->cumulative_size - start != it->size) {
+            return false;
+        }
+
+        auto from = std::max(start, offset);
+        auto to = std::min<uint64_t>(it->cumulative_size, end);
+        extents.push_back({size_t(it->offset + (from - start)), size_t(to - from)});
+    }
+
+    return start >= end;
+}
+
+bool read_data_stream(const MappedFile *file, size_t start_offset, const data_chunk_callback_t &callback) {
+    std::vector<uint8_t> buffer;
+
+    while (true) {
+        segment_t seg;
+        if (!read_segment_header(file, start_offset, seg)) {
+            return false;
+        }
+
+        if (seg.size == 0) {
+            break;
+        }
+
+        auto data = file->get(seg.offset, seg.size);
+        start_offset = seg.offset + seg.size;
+
+        if (!seg.compressed) {
+            callback(data, seg.size);
+            continue;
+        }
+
+        buffer.clear();
+        auto array = SafeArray::create(data, seg.size);
+        auto ok = decompress(array.get(), buffer);
+        if (!buffer.empty()) {
+            callback(buffer.data(), buffer.size());
+        }
+
+        if (!ok) {
+            fprintf(stderr, "%sdecompression failed\n", t_log_prefix);
+            return false;
+        }
     }
 
     return true;
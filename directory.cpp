@@ -20,14 +20,12 @@
 /// SOFTWARE.
 ///
 
-#include <deque>
-#include <memory>
-#include <stack>
 #include <vector>
 #include "main.h"
 #include "qic.h"
+#include "thread_pool.h"
 
-bool read_dir_entry(const SafeArray *buffer, size_t &offset, parsed_dir_entry_t &entry) {
+bool read_dir_entry(const SafeArray *buffer, size_t &offset, parsed_dir_entry_t &entry, StringArena &names) {
     entry.dir1_offset = offset;
 
     auto d1 = buffer->get<ms_dir_fixed_t>(offset);
@@ -42,7 +40,7 @@ bool read_dir_entry(const SafeArray *buffer, size_t &offset, parsed_dir_entry_t
         if (!name_ptr) {
             return false;
         }
-        entry.long_name = utf16_to_utf8(name_ptr, d1->nm_len);
+        entry.long_name = utf16_to_utf8(name_ptr, d1->nm_len, names);
         offset += d1->nm_len;
     }
 
@@ -64,7 +62,7 @@ bool read_dir_entry(const SafeArray *buffer, size_t &offset, parsed_dir_entry_t
             return false;
         }
 
-        entry.short_name = utf16_to_utf8(name_ptr, dos_len);
+        entry.short_name = utf16_to_utf8(name_ptr, dos_len, names);
         offset += dos_len;
     }
 
@@ -75,71 +73,147 @@ bool read_dir_entry(const SafeArray *buffer, size_t &offset, parsed_dir_entry_t
     entry.dir_data_length = offset - entry.dir1_offset;
     entry.path_len = d1->path_len;
     entry.file_size = d1->file_len;
-    entry.mtime = get_time(d1->m_datetime);
-    entry.atime = get_time(d1->a_datetime);
+    entry.m_datetime = d1->m_datetime;
+    entry.a_datetime = d1->a_datetime;
 
     return true;
 }
 
-bool read_dir_entries(const SafeArray *buffer, std::vector<parsed_dir_entry_t> &dirs) {
-    size_t offset = 0;
+// A run of entries, from the offset of the first one and its index.
+struct dir_chunk_t {
+    size_t offset;
+    size_t first;
+};
 
-    while (true) {
-        parsed_dir_entry_t entry;
+// Walks the entries without decoding them, up to the last one or to the first that runs past the end of the buffer.
+// Splits them in chunks of about chunk_size bytes, followed by the end of the last complete entry. The lengths of
+// the names are used rather than rec_len, which is not always valid.
+static bool find_dir_entries(const SafeArray *buffer, size_t chunk_size, std::vector<dir_chunk_t> &chunks) {
+    chunks.assign(1, {0, 0});
+    size_t offset = 0, count = 0;
 
-        if (!read_dir_entry(buffer, offset, entry)) {
-            return false;
+    while (true) {
+        auto d1 = buffer->get<ms_dir_fixed_t>(offset);
+        if (!d1) {
+            break;
         }
 
-        dirs.push_back(entry);
+        auto d2 = buffer->get<ms_dir_fixed2_t>(offset + sizeof(ms_dir_fixed_t) + d1->nm_len);
+        if (!d2) {
+            break;
+        }
 
-        if (entry.is_dir_end) {
+        auto dos_len = d2->nm_len ? d2->nm_len : d1->nm_len;
+        auto end = offset + sizeof(ms_dir_fixed_t) + d1->nm_len + sizeof(ms_dir_fixed2_t) + dos_len;
+        if (end > buffer->size()) {
             break;
         }
+
+        offset = end;
+        ++count;
+        if (d1->flag & DIREND) {
+            chunks.push_back({offset, count});
+            return true;
+        }
+
+        if (offset - chunks.back().offset >= chunk_size) {
+            chunks.push_back({offset, count});
+        }
     }
 
-    return true;
+    if (chunks.back().first != count) {
+        chunks.push_back({offset, count});
+    }
+    return false;
 }
 
-template <typename T> using vector_ptr = std::shared_ptr<std::deque<T>>;
+// Decodes the entries of a chunk, up to the start of the next one, into the catalog.
+static void decode_dir_entries(const SafeArray *buffer, const dir_chunk_t &chunk, const dir_chunk_t &next,
+                               Catalog &catalog) {
+    // UTF-8 takes at most three bytes for every two of UTF-16, and each name a NUL.
+    auto count = next.first - chunk.first;
+    auto name_size = next.offset - chunk.offset - count * (sizeof(ms_dir_fixed_t) + sizeof(ms_dir_fixed2_t));
+    catalog.reserve(catalog.size() + count, name_size / 2 * 3 + count * 2);
+
+    // Names are decoded in a scratch arena, then copied to the pool of the catalog.
+    StringArena names;
+    auto offset = chunk.offset;
+    for (size_t i = 0; i < count; ++i) {
+        parsed_dir_entry_t entry;
+        names.clear();
+        read_dir_entry(buffer, offset, entry, names);
+        catalog.add(entry);
+    }
+}
 
-void reconstruct_tree(std::vector<parsed_dir_entry_t> &dirs) {
-    parsed_dir_entry_t *current_parent = nullptr;
+// Each thread gets a few chunks, so that one with longer names does not hold back the others.
+static const size_t MIN_DIR_CHUNK_SIZE = 256 * 1024;
+static const size_t DIR_CHUNKS_PER_THREAD = 4;
 
-    std::stack<vector_ptr<parsed_dir_entry_t *>> stack;
+bool read_dir_entries(const SafeArray *buffer, Catalog &catalog, ThreadPool *pool) {
+    // Entries are found first, so that they can be decoded in parallel.
+    auto chunk_size = SIZE_MAX;
+    if (pool && pool->size() > 1) {
+        chunk_size = std::max(buffer->size() / (pool->size() * DIR_CHUNKS_PER_THREAD), MIN_DIR_CHUNK_SIZE);
+    }
 
-    auto current_level = std::make_shared<std::deque<parsed_dir_entry_t *>>();
-    current_level->push_back(nullptr);
-    stack.push(current_level);
+    std::vector<dir_chunk_t> chunks;
+    auto complete = find_dir_entries(buffer, chunk_size, chunks);
+    auto chunk_count = chunks.size() - 1;
+    if (chunk_count <= 1) {
+        decode_dir_entries(buffer, chunks.front(), chunks.back(), catalog);
+        return complete;
+    }
+
+    // Each chunk is decoded in a catalog of its own. Their entries are then copied in place, in parallel as well.
+    std::vector<Catalog> parts(chunk_count);
+    pool->parallel_for(chunk_count, [&](size_t i) { decode_dir_entries(buffer, chunks[i], chunks[i + 1], parts[i]); });
+
+    std::vector<size_t> nodes, name_offsets;
+    for (const auto &part : parts) {
+        nodes.push_back(catalog.size());
+        name_offsets.push_back(catalog.names_size());
+        catalog.grow(part.size(), part.names_size());
+    }
 
+    pool->parallel_for(chunk_count, [&](size_t i) { catalog.place(parts[i], nodes[i], name_offsets[i]); });
+
+    return complete;
+}
+
+// Each directory with children is followed, after the entries of its own level, by a group of entries that ends
+// with the last entry flag, depth first: the groups of the directories of a level come before the next directory
+// of the parent level. The directories whose group is yet to come are kept on a stack, the directories of a level
+// being reversed once it is complete so that the first one is on top.
+void reconstruct_tree(Catalog &catalog) {
+    std::vector<uint32_t> pending = {Catalog::NO_NODE};
+    auto parent = Catalog::NO_NODE;
+    size_t level_start = 0;
     bool first = true;
 
-    for (int i = 0; i < dirs.size(); ++i) {
+    for (uint32_t i = 0; i < catalog.size(); ++i) {
         if (first) {
             first = false;
-            auto top = stack.top();
-            current_parent = top->front();
-            top->pop_front();
-            if (top->empty()) {
-                stack.pop();
+            // A catalog with more groups than directories leaves the entries of the extra groups at the top.
+            parent = Catalog::NO_NODE;
+            if (!pending.empty()) {
+                parent = pending.back();
+                pending.pop_back();
             }
-
-            stack.push(std::make_shared<std::deque<parsed_dir_entry_t *>>());
+            level_start = pending.size();
         }
 
-        auto current_entry = &dirs[i];
-        current_entry->parent = current_parent;
+        catalog.set_parent(i, parent);
 
-        auto has_children = current_entry->is_dir && !current_entry->is_empty_dir;
-        if (has_children) {
-            stack.top()->push_back(current_entry);
+        if (catalog.is_dir(i) && !catalog.is_empty_dir(i)) {
+            pending.push_back(i);
         }
 
-        if (current_entry->is_last_entry) {
+        if (catalog.is_last_entry(i)) {
             first = true;
-            if (stack.top()->size() == 0) {
-                stack.pop();
-            }
+            std::reverse(pending.begin() + level_start, pending.end());
         }
     }
+
+    catalog.index_tree();
 }
@@ -0,0 +1,230 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "main.h"
+
+static const char INDEX_MAGIC[8] = {'Q', 'I', 'C', 'I', 'D', 'X', 0, 0};
+static const uint32_t INDEX_VERSION = 2;
+
+struct index_header_t {
+    char magic[8];
+    uint32_t version;
+    // The archive the index was built from.
+    uint64_t archive_size;
+    int64_t archive_mtime_sec;
+    int64_t archive_mtime_nsec;
+    uint64_t header_hash;
+
+    uint64_t data_offset;
+    uint8_t complete;
+    uint64_t segment_count;
+    uint64_t file_count;
+} __attribute__((packed));
+
+struct index_segment_t {
+    uint64_t offset;
+    uint32_t size;
+    uint8_t compressed;
+    uint64_t cumulative_size;
+} __attribute__((packed));
+
+struct index_file_t {
+    uint64_t offset;
+    uint64_t guessed_size;
+    uint8_t has_guessed_size;
+    int64_t mtime;
+    int64_t atime;
+    // Followed by the path.
+    uint16_t path_len;
+} __attribute__((packed));
+
+// FNV-1a of the volume table and media id that precede the data region.
+static uint64_t get_header_hash(const MappedFile *archive, size_t data_offset) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto size = std::min(data_offset, archive->size());
+    auto data = archive->get(0, size);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool get_archive_header(const MappedFile *archive, size_t data_offset, index_header_t &header) {
+    struct stat st;
+    if (fstat(archive->fd(), &st) < 0) {
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.archive_size = archive->size();
+    header.archive_mtime_sec = st.st_mtim.tv_sec;
+    header.archive_mtime_nsec = st.st_mtim.tv_nsec;
+    header.header_hash = get_header_hash(archive, data_offset);
+    header.data_offset = data_offset;
+    return true;
+}
+
+static bool read_whole_file(const std::string &path, std::vector<uint8_t> &buffer) {
+    auto fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    uint8_t chunk[64 * 1024];
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        buffer.insert(buffer.end(), chunk, chunk + size);
+    }
+
+    auto ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+bool load_index(const std::string &index_path, const MappedFile *archive, archive_index_t &index) {
+    std::vector<uint8_t> buffer;
+    if (!read_whole_file(index_path, buffer)) {
+        return false;
+    }
+
+    auto data = SafeArray::create(buffer);
+    auto header = data->get<index_header_t>(0);
+    if (!header) {
+        return false;
+    }
+
+    // The index is only good for the very archive it was built from.
+    index_header_t expected;
+    if (!get_archive_header(archive, header->data_offset, expected) ||
+        memcmp(header->magic, expected.magic, sizeof(expected.magic)) || header->version != expected.version ||
+        header->archive_size != expected.archive_size || header->archive_mtime_sec != expected.archive_mtime_sec ||
+        header->archive_mtime_nsec != expected.archive_mtime_nsec || header->header_hash != expected.header_hash) {
+        return false;
+    }
+
+    size_t offset = sizeof(*header);
+    archive_index_t result;
+    result.data_offset = header->data_offset;
+    result.complete = header->complete;
+
+    for (uint64_t i = 0; i < header->segment_count; ++i) {
+        auto seg = data->get<index_segment_t>(offset);
+        if (!seg || !archive->get(seg->offset, seg->size)) {
+            return false;
+        }
+
+        result.segments.push_back({seg->offset, seg->size, seg->compressed != 0, seg->cumulative_size});
+        offset += sizeof(*seg);
+    }
+
+    for (uint64_t i = 0; i < header->file_count; ++i) {
+        auto file = data->get<index_file_t>(offset);
+        if (!file) {
+            return false;
+        }
+
+        offset += sizeof(*file);
+        auto path = data->get(offset, file->path_len);
+        if (!path) {
+            return false;
+        }
+
+        recovered_file_entry_t entry;
+        entry.path.assign((const char *) path, file->path_len);
+        entry.offset = file->offset;
+        entry.has_guessed_size = file->has_guessed_size;
+        entry.guessed_size = file->guessed_size;
+        entry.mtime = file->mtime;
+        entry.atime = file->atime;
+        result.files.push_back(entry);
+
+        offset += file->path_len;
+    }
+
+    if (offset != data->size()) {
+        return false;
+    }
+
+    index = std::move(result);
+    return true;
+}
+
+bool save_index(const std::string &index_path, const MappedFile *archive, const archive_index_t &index) {
+    index_header_t header;
+    if (!get_archive_header(archive, index.data_offset, header)) {
+        return false;
+    }
+
+    header.complete = index.complete;
+    header.segment_count = index.segments.size();
+    header.file_count = index.files.size();
+
+    std::vector<uint8_t> buffer;
+    auto append = [&](const void *data, size_t size) {
+        buffer.insert(buffer.end(), (const uint8_t *) data, (const uint8_t *) data + size);
+    };
+
+    append(&header, sizeof(header));
+
+    for (const auto &seg : index.segments) {
+        index_segment_t s = {seg.offset, (uint32_t) seg.size, seg.compressed, seg.cumulative_size};
+        append(&s, sizeof(s));
+    }
+
+    for (const auto &entry : index.files) {
+        if (entry.path.size() > UINT16_MAX) {
+            return false;
+        }
+
+        index_file_t f = {entry.offset,
+                          entry.guessed_size,
+                          entry.has_guessed_size,
+                          entry.mtime,
+                          entry.atime,
+                          (uint16_t) entry.path.size()};
+        append(&f, sizeof(f));
+        append(entry.path.data(), entry.path.size());
+    }
+
+    // Write to a temporary file first, so that a concurrent or interrupted run never sees half an index.
+    auto tmp_path = index_path + ".tmp";
+    auto fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    auto ok = fwrite(buffer.data(), buffer.size(), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), index_path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
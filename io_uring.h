@@ -0,0 +1,168 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#ifndef _IO_URING_H_
+#define _IO_URING_H_
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// Minimal io_uring submission and completion rings on top of the raw syscalls, with a table of direct
+// descriptors that linked requests use to pass a file from an open to the requests that follow it.
+class IoUring {
+    int m_fd;
+
+    void *m_sq_ring;
+    size_t m_sq_ring_size;
+    void *m_cq_ring;
+    size_t m_cq_ring_size;
+    io_uring_sqe *m_sqes;
+    size_t m_sqes_size;
+
+    unsigned *m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned *m_sq_array;
+    unsigned m_sq_local_tail;
+
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe *m_cqes;
+
+    IoUring()
+        : m_fd(-1), m_sq_ring(MAP_FAILED), m_sq_ring_size(0), m_cq_ring(MAP_FAILED), m_cq_ring_size(0),
+          m_sqes((io_uring_sqe *) MAP_FAILED), m_sqes_size(0) {
+    }
+
+    bool init(unsigned entries, unsigned file_count) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0) {
+            return false;
+        }
+
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                         IORING_OFF_SQ_RING);
+        m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                         IORING_OFF_CQ_RING);
+        m_sqes = (io_uring_sqe *) mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                                       IORING_OFF_SQES);
+        if (m_sq_ring == MAP_FAILED || m_cq_ring == MAP_FAILED || m_sqes == MAP_FAILED) {
+            return false;
+        }
+
+        auto sq = (uint8_t *) m_sq_ring;
+        m_sq_tail = (unsigned *) (sq + params.sq_off.tail);
+        m_sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+        m_sq_array = (unsigned *) (sq + params.sq_off.array);
+        m_sq_local_tail = *m_sq_tail;
+
+        auto cq = (uint8_t *) m_cq_ring;
+        m_cq_head = (unsigned *) (cq + params.cq_off.head);
+        m_cq_tail = (unsigned *) (cq + params.cq_off.tail);
+        m_cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+        // An empty table of direct descriptors, filled by the opens.
+        io_uring_rsrc_register files;
+        memset(&files, 0, sizeof(files));
+        files.nr = file_count;
+        files.flags = IORING_RSRC_REGISTER_SPARSE;
+        return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0;
+    }
+
+public:
+    ~IoUring() {
+        if (m_sqes != MAP_FAILED) {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (m_cq_ring != MAP_FAILED) {
+            munmap(m_cq_ring, m_cq_ring_size);
+        }
+        if (m_sq_ring != MAP_FAILED) {
+            munmap(m_sq_ring, m_sq_ring_size);
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    // Returns null when the kernel does not support io_uring or forbids it.
+    static std::shared_ptr<IoUring> create(unsigned entries, unsigned file_count) {
+        auto ring = std::shared_ptr<IoUring>(new IoUring());
+        if (!ring->init(entries, file_count)) {
+            return nullptr;
+        }
+        return ring;
+    }
+
+    // Returns a cleared entry to fill. The caller makes sure not to queue more entries than the ring has.
+    io_uring_sqe *get_sqe() {
+        auto index = m_sq_local_tail & m_sq_mask;
+        auto sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sq_array[index] = index;
+        ++m_sq_local_tail;
+        return sqe;
+    }
+
+    // Submits the queued entries and waits for at least wait_count completions.
+    bool submit(unsigned wait_count) {
+        auto tail = __atomic_load_n(m_sq_tail, __ATOMIC_RELAXED);
+        auto count = m_sq_local_tail - tail;
+        __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+        auto flags = wait_count ? IORING_ENTER_GETEVENTS : 0;
+        while (true) {
+            auto ret = syscall(__NR_io_uring_enter, m_fd, count, wait_count, flags, nullptr, 0);
+            if (ret >= 0) {
+                return true;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // Calls func with each available completion.
+    template <typename F> void reap(F func) {
+        auto head = *m_cq_head;
+        auto tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            func(m_cqes[head & m_cq_mask]);
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    }
+};
+
+#endif
@@ -0,0 +1,193 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#include <string>
+#include <vector>
+#include "buffered_writer.h"
+#include "main.h"
+
+// Writes a QIC time, seconds since 1970 in the local time of the backup, as YYYY-MM-DD HH:MM:SS. Unlike get_time,
+// this uses the right calendar, so extracted files get times about a month past the listed ones.
+static void put_time(BufferedWriter &out, uint32_t time) {
+    long days = time / 86400;
+    auto seconds = time % 86400;
+
+    // Date of the proleptic Gregorian calendar, from the days since 1970-01-01.
+    days += 719468;
+    auto era = days / 146097;
+    unsigned doe = days - era * 146097;
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned mday = doy - (153 * mp + 2) / 5 + 1;
+    unsigned mon = mp < 10 ? mp + 3 : mp - 9;
+    long year = yoe + era * 400 + (mon <= 2);
+
+    char text[] = "0000-00-00 00:00:00";
+    auto digits = [&](size_t pos, unsigned long value, size_t count) {
+        for (; count > 0; --count, value /= 10) {
+            text[pos + count - 1] = '0' + value % 10;
+        }
+    };
+    digits(0, year, 4);
+    digits(5, mon, 2);
+    digits(8, mday, 2);
+    digits(11, seconds / 3600, 2);
+    digits(14, seconds / 60 % 60, 2);
+    digits(17, seconds % 60, 2);
+    out.write(std::string_view(text, sizeof(text) - 1));
+}
+
+// Names are valid UTF-8, only quotes, backslashes and control characters are escaped.
+static void put_json_string(BufferedWriter &out, std::string_view str) {
+    static const char HEX[] = "0123456789abcdef";
+
+    out.put('"');
+    size_t start = 0;
+    for (size_t i = 0; i < str.size(); ++i) {
+        uint8_t c = str[i];
+        if (c >= ' ' && c != '"' && c != '\\') {
+            continue;
+        }
+
+        out.write(str.substr(start, i - start));
+        if (c == '"' || c == '\\') {
+            out.put('\\');
+            out.put(c);
+        } else {
+            out.write("\\u00");
+            out.put(HEX[c >> 4]);
+            out.put(HEX[c & 15]);
+        }
+        start = i + 1;
+    }
+    out.write(str.substr(start));
+    out.put('"');
+}
+
+static void put_csv_field(BufferedWriter &out, std::string_view str) {
+    if (str.find_first_of(",\"\r\n") == std::string_view::npos) {
+        out.write(str);
+        return;
+    }
+
+    out.put('"');
+    for (auto c : str) {
+        if (c == '"') {
+            out.put('"');
+        }
+        out.put(c);
+    }
+    out.put('"');
+}
+
+static void put_entry(BufferedWriter &out, list_format_t format, const Catalog &catalog, uint32_t node,
+                      std::string_view path) {
+    auto is_dir = catalog.is_dir(node);
+    auto size = is_dir ? 0 : catalog.file_size(node);
+
+    switch (format) {
+        case LIST_TEXT:
+            out.put(is_dir ? 'd' : '-');
+            out.put(' ');
+            out.put_number(size, 12);
+            out.put(' ');
+            put_time(out, catalog.mtime(node));
+            out.put(' ');
+            out.write(path);
+            out.put('\n');
+            break;
+
+        case LIST_JSON:
+            out.write("{\"path\":");
+            put_json_string(out, path);
+            out.write(is_dir ? ",\"type\":\"dir\",\"size\":" : ",\"type\":\"file\",\"size\":");
+            out.put_number(size);
+            out.write(",\"mtime\":\"");
+            put_time(out, catalog.mtime(node));
+            out.write("\"}");
+            break;
+
+        case LIST_CSV:
+            put_csv_field(out, path);
+            out.write(is_dir ? ",dir," : ",file,");
+            out.put_number(size);
+            out.put(',');
+            put_time(out, catalog.mtime(node));
+            out.put('\n');
+            break;
+    }
+}
+
+bool list_catalog(const Catalog &catalog, list_format_t format, int fd) {
+    BufferedWriter out(fd);
+    if (format == LIST_CSV) {
+        out.write("path,type,size,mtime\n");
+    } else if (format == LIST_JSON) {
+        out.put('[');
+    }
+
+    // Depth first from the roots, the path being built up in place. The nameless root does not add to the paths of
+    // its children and is not listed.
+    std::vector<uint32_t> stack;
+    for (auto node = (uint32_t) catalog.size(); node-- > 0;) {
+        if (catalog.parent(node) == Catalog::NO_NODE) {
+            stack.push_back(node);
+        }
+    }
+
+    std::string path;
+    // Size of the path of the last node visited at each depth, which is the parent of the next one at the depth
+    // below.
+    std::vector<size_t> prefixes(1, 0);
+    bool first = true;
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+
+        auto depth = catalog.depth(node);
+        auto name = catalog.long_name(node);
+        path.resize(prefixes[depth]);
+        if (depth > 0 || !name.empty()) {
+            path += '/';
+            path += name;
+
+            if (format == LIST_JSON) {
+                out.write(first ? "\n" : ",\n");
+            }
+            put_entry(out, format, catalog, node, path);
+            first = false;
+        }
+
+        prefixes.resize(std::max<size_t>(prefixes.size(), depth + 2));
+        prefixes[depth + 1] = path.size();
+        for (auto i = catalog.child_count(node); i-- > 0;) {
+            stack.push_back(catalog.child(node, i));
+        }
+    }
+
+    if (format == LIST_JSON) {
+        out.write(first ? "]\n" : "\n]\n");
+    }
+
+    return out.flush();
+}
@@ -20,115 +20,258 @@
 /// SOFTWARE.
 ///
 
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include "main.h"
+#include "path_table.h"
 #include "qic.h"
+#include "thread_pool.h"
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s /path/to/file.qic\n", argv[0]);
-        return -1;
+// Writing small files is bound by the latency of metadata syscalls rather than by the CPU.
+static const unsigned DEFAULT_WRITER_COUNT = 8;
+
+// Far more threads than any machine has cores or any disk has queue slots for.
+static const unsigned MAX_THREAD_COUNT = 1024;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j threads] [-w writers] [-u] [-s] [-n] /path/to/file.qic\n", prog);
+    fprintf(stderr, "       %s [-j threads] [-n] extract /path/to/file.qic /path/in/backup\n", prog);
+    fprintf(stderr, "       %s [-j threads] [-f format] list /path/to/file.qic\n", prog);
+    fprintf(stderr, "       %s [-j threads] [-w writers] [-u] [-n] [-m memory] batch /path/to/output file.qic|dir...\n",
+            prog);
+    fprintf(stderr, "  -j threads  Number of decoding threads, defaults to the number of CPUs\n");
+    fprintf(stderr, "  -w writers  Number of threads writing extracted files, defaults to %u\n", DEFAULT_WRITER_COUNT);
+    fprintf(stderr, "  -u          Write extracted files through io_uring when the kernel supports it\n");
+    fprintf(stderr, "  -s          Stream the data region instead of decoding it all in memory first\n");
+    fprintf(stderr, "  -n          Do not use or write the index file kept next to the archive\n");
+    fprintf(stderr, "  -f format   Listing format: text, json or csv, defaults to text\n");
+    fprintf(stderr, "  -m memory   Megabytes that a batch may decode at once, defaults to half of the RAM\n");
+    fprintf(stderr, "Times are listed as recorded. Extracted files keep the times of the original conversion,\n");
+    fprintf(stderr, "which are about a month later.\n");
+}
+
+// Parses a decimal number from 1 to max, returns 0 for anything else.
+static unsigned long long parse_count(const char *value, unsigned long long max) {
+    char *end;
+    errno = 0;
+    auto count = strtoull(value, &end, 10);
+    if (!isdigit((unsigned char) value[0]) || *end || errno || count > max) {
+        return 0;
     }
+    return count;
+}
 
-    auto file = MappedFile::create(argv[1]);
-    if (!file) {
-        fprintf(stderr, "Could not open %s\n", argv[1]);
-        return -2;
+// Backup paths start with the empty name of the root directory, which makes them begin with "//".
+static std::string normalize_path(const std::string &path) {
+    std::string ret = "/";
+    for (auto c : path) {
+        if (c != '/' || ret.back() != '/') {
+            ret.push_back(c);
+        }
     }
+    return ret;
+}
 
-    auto vtbl = file->get<qic_vtbl_t>(0);
-    if (!vtbl) {
-        fprintf(stderr, "Could not read vtbl\n");
-        return -3;
+// Loads the index of the archive, or builds it in one pass over the whole data region.
+static void get_index(const std::string &index_path, const MappedFile *file, size_t data_offset, ThreadPool *pool,
+                      bool use_index, archive_index_t &index) {
+    if (use_index && load_index(index_path, file, index) && index.data_offset == data_offset) {
+        return;
     }
 
-    auto mdid = get_mdid(file.get(), sizeof(qic_vtbl_t));
-    if (mdid.empty()) {
-        fprintf(stderr, "Could not read mdid\n");
-        return -4;
+    index = archive_index_t();
+    index.data_offset = data_offset;
+
+    std::vector<uint8_t> buffer;
+    std::vector<size_t> signatures;
+    index.complete = read_data_segment(file, data_offset, buffer, pool, &index.segments, &signatures);
+    auto file_data = SafeArray::create(buffer);
+    recover_files(file_data.get(), index.files, pool, &signatures);
+
+    if (use_index && !save_index(index_path, file, index)) {
+        fprintf(stderr, "Could not write index %s\n", index_path.c_str());
     }
+}
 
-    auto i = vtbl->dir_size / SEG_SZ;
-    if (vtbl->dir_size % SEG_SZ) {
-        i++;
+static int extract_single_file(const std::string &path, const MappedFile *file, size_t data_offset, ThreadPool *pool,
+                               bool use_index, const PathTable &paths, const std::string &wanted) {
+    archive_index_t index;
+    get_index(path + ".idx", file, data_offset, pool, use_index, index);
+
+    // Like a full recovery, the last record of the path that is in the catalog and extracts wins, earlier ones
+    // standing in for it when its data is lost.
+    auto wanted_path = normalize_path(wanted);
+    std::vector<const recovered_file_entry_t *> found;
+    for (const auto &entry : index.files) {
+        if (normalize_path(entry.path) == wanted_path) {
+            found.push_back(&entry);
+        }
     }
-    auto dir_offset = file->size() - i * SEG_SZ;
 
-    std::vector<uint8_t> dir_buffer;
-    if (!read_catalog(file.get(), dir_offset, vtbl->dir_size, dir_buffer)) {
-        fprintf(stderr, "Could not read catalog\n");
-        return -5;
+    if (found.empty()) {
+        fprintf(stderr, "Could not find %s in archive\n", wanted.c_str());
+        return -8;
     }
 
-    auto dir_data = SafeArray::create(dir_buffer);
-    std::vector<parsed_dir_entry_t> parsed_entries;
-    if (!read_dir_entries(dir_data.get(), parsed_entries)) {
-        fprintf(stderr, "Could not parse dir entries");
-        return -6;
+    auto error_count = 0;
+    for (auto it = found.rbegin(); it != found.rend(); ++it) {
+        auto entry = **it;
+        auto node = paths.find(entry.path);
+        if (node == Catalog::NO_NODE) {
+            fprintf(stderr, "Could not find %s in directory catalog\n", entry.path.c_str());
+            ++error_count;
+            continue;
+        }
+
+        reconcile_with_catalog(paths.catalog(), node, entry, error_count);
+        if (!extract_indexed_file(file, index, &entry, pool)) {
+            fprintf(stderr, "Could not extract %s\n", entry.path.c_str());
+            ++error_count;
+            continue;
+        }
+
+        printf("%s size=%zu offset=%#zx error_count=%d\n", entry.path.c_str(), entry.guessed_size, entry.offset,
+               error_count);
+        return 0;
     }
 
-    std::unordered_map<std::string, const parsed_dir_entry_t *> m_file_map;
-    reconstruct_tree(parsed_entries);
-    auto file_count = 0;
-    for (const auto &entry : parsed_entries) {
-        auto path = entry.get_recursive_path();
-        printf("D=%d ED=%d LE=%d LN=%-20s %s\n", entry.is_dir, entry.is_empty_dir, entry.is_last_entry,
-               entry.long_name.c_str(), path.c_str());
-        if (!entry.is_dir) {
-            file_count++;
+    return -9;
+}
+
+int main(int argc, char **argv) {
+    unsigned thread_count = 0;
+    unsigned writer_count = DEFAULT_WRITER_COUNT;
+    bool streaming = false;
+    bool use_uring = false;
+    bool use_index = true;
+    auto format = LIST_TEXT;
+    uint64_t memory_limit = (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 2;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:w:usnf:m:")) != -1) {
+        switch (opt) {
+            case 'j':
+                thread_count = parse_count(optarg, MAX_THREAD_COUNT);
+                if (thread_count == 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'w':
+                writer_count = parse_count(optarg, MAX_THREAD_COUNT);
+                if (writer_count == 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'u':
+                use_uring = true;
+                break;
+            case 's':
+                streaming = true;
+                break;
+            case 'n':
+                use_index = false;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "text")) {
+                    format = LIST_TEXT;
+                } else if (!strcmp(optarg, "json")) {
+                    format = LIST_JSON;
+                } else if (!strcmp(optarg, "csv")) {
+                    format = LIST_CSV;
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'm':
+                memory_limit = parse_count(optarg, UINT64_MAX >> 20) << 20;
+                if (memory_limit == 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
         }
+    }
 
-        m_file_map[path] = &entry;
+    if (argc - optind >= 3 && !strcmp(argv[optind], "batch")) {
+        std::vector<std::string> inputs(argv + optind + 2, argv + argc);
+        auto pool = ThreadPool::create(thread_count);
+        auto writers = ThreadPool::create(writer_count);
+        return run_batch(inputs, argv[optind + 1], pool.get(), writers.get(), use_uring, use_index, memory_limit);
     }
 
-    // Read compressed file data.
-    auto file_data_offset = 0x100;
-    std::vector<uint8_t> file_buffer;
-    if (!read_data_segment(file.get(), file_data_offset, file_buffer)) {
-        fprintf(stderr, "Could not read data segment\n");
-        // return -7;
+    const char *extract_path = nullptr;
+    bool listing = false;
+    if (argc - optind == 3 && !strcmp(argv[optind], "extract")) {
+        extract_path = argv[optind + 2];
+        ++optind;
+    } else if (argc - optind == 2 && !strcmp(argv[optind], "list")) {
+        listing = true;
+        ++optind;
+    } else if (argc - optind != 1) {
+        usage(argv[0]);
+        return -1;
     }
 
-    auto file_data = SafeArray::create(file_buffer);
-    std::vector<recovered_file_entry_t> recovered_files;
-    recover_files(file_data.get(), recovered_files);
+    auto path = argv[optind];
+    auto file = MappedFile::create(path);
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -2;
+    }
 
-    auto total_size = 0;
-    auto error_count = 0;
-    for (const auto &file : recovered_files) {
-        printf("%s gs=%d size=%d offset=%#x\n", file.path.c_str(), file.has_guessed_size, file.guessed_size,
-               file.offset);
-        total_size += file.guessed_size;
+    auto pool = ThreadPool::create(thread_count);
 
-        auto final_size = file.guessed_size;
+    Catalog catalog;
+    auto status = read_archive_catalog(file.get(), pool.get(), catalog);
+    if (status) {
+        return status;
+    }
 
-        auto it = m_file_map.find(file.path);
-        if (it == m_file_map.end()) {
-            fprintf(stderr, "Could not find %s in directory catalog\n", file.path.c_str());
-            ++error_count;
-            continue;
-        }
+    // Listing only needs the catalog, the data region is not read at all.
+    if (listing) {
+        return list_catalog(catalog, format, STDOUT_FILENO) ? 0 : -10;
+    }
 
-        auto final_entry = file;
-        if ((*it).second->file_size != file.guessed_size) {
-            fprintf(stderr, "Mismatched file size for %s: catalog: %#x recovered: %#x\n", file.path.c_str(),
-                    (*it).second->file_size, file.guessed_size);
-            ++error_count;
+    PathTable paths(catalog);
+    if (extract_path) {
+        return extract_single_file(path, file.get(), DATA_OFFSET, pool.get(), use_index, paths, extract_path);
+    }
 
-            if (final_size == 0) {
-                final_size = (*it).second->file_size;
-            } else {
-                final_entry.may_be_corrupted = true;
-            }
+    for (uint32_t node = 0; node < catalog.size(); ++node) {
+        printf("D=%d ED=%d LE=%d LN=%-20s %s\n", catalog.is_dir(node), catalog.is_empty_dir(node),
+               catalog.is_last_entry(node), catalog.long_name(node).data(), catalog.get_recursive_path(node).c_str());
+    }
+    auto file_count = get_file_count(catalog);
+
+    if (streaming) {
+        recovery_stats_t stats;
+        if (!recover_files_streaming(file.get(), DATA_OFFSET, paths, stats)) {
+            fprintf(stderr, "Could not read data segment\n");
         }
 
-        final_entry.guessed_size = final_size;
-        extract_file(file_data.get(), &final_entry);
+        printf("error_count=%d file_count: %d recovered_file_count: %zu total_size: %zu\n", stats.error_count,
+               file_count, stats.recovered_count, stats.total_size);
+        update_times_for_dirs(paths, pool.get());
+        return 0;
     }
 
-    printf("error_count=%d file_count: %d recovered_file_count: %d total_size: %d\n", error_count, file_count,
-           recovered_files.size(), total_size);
+    recovery_stats_t stats;
+    auto writers = ThreadPool::create(writer_count);
+    recover_archive(path, file.get(), paths, pool.get(), writers.get(), use_uring, use_index, ".", true, stats);
+
+    printf("error_count=%d file_count: %d recovered_file_count: %zu total_size: %zu\n", stats.error_count, file_count,
+           stats.recovered_count, stats.total_size);
 
-    update_times_for_dirs(parsed_entries);
+    update_times_for_dirs(paths, writers.get());
 
     return 0;
 }
\ No newline at end of file
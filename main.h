@@ -25,57 +25,238 @@
 #define _MAIN_H_
 
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
+#include <functional>
 #include <inttypes.h>
 #include <unordered_map>
 #include <vector>
 
 #include "mapped_file.h"
+#include "string_arena.h"
 
 namespace fs = std::filesystem;
 
+class ThreadPool;
+class PathTable;
+
+// A directory entry as read from the catalog or a file record. Names point into the arena it was read with and
+// are NUL-terminated. Times are kept in their QIC form until they are needed, get_time converts them.
 struct parsed_dir_entry_t {
-    std::string long_name;
-    std::string short_name;
-    std::string qic_path;
-    bool is_dir;
-    bool is_empty_dir;
-    bool is_last_entry;
-    bool is_dir_end;
-    parsed_dir_entry_t *parent;
-
-    size_t dir1_offset;
-    size_t dir_data_length;
-
-    size_t path_len;
-    size_t file_size;
-
-    struct tm mtime;
-    struct tm atime;
-
-    std::string get_recursive_path() const {
-        std::vector<std::string> items;
-        for (auto current = this; current; current = current->parent) {
-            items.push_back(current->long_name);
+    std::string_view long_name = "";
+    std::string_view short_name = "";
+    bool is_dir = false;
+    bool is_empty_dir = false;
+    bool is_last_entry = false;
+    bool is_dir_end = false;
+
+    size_t dir1_offset = 0;
+    size_t dir_data_length = 0;
+
+    size_t path_len = 0;
+    size_t file_size = 0;
+
+    uint32_t m_datetime = 0;
+    uint32_t a_datetime = 0;
+};
+
+// The catalog, stored column by column so that passes over the tree only touch the fields they need, in 25 bytes
+// per entry and 12 more once the tree is indexed. Entries are referred to by their index. Their names are kept in a
+// single pool, the long name of each entry followed by its short name, both NUL-terminated, so that their sizes
+// follow from the offsets.
+class Catalog {
+    static constexpr uint8_t IS_DIR = 1;
+    static constexpr uint8_t IS_EMPTY_DIR = 2;
+    static constexpr uint8_t IS_LAST_ENTRY = 4;
+    static constexpr uint8_t IS_DIR_END = 8;
+
+    std::vector<uint8_t> m_flags;
+    std::vector<uint32_t> m_parents;
+    std::vector<uint32_t> m_file_sizes;
+    std::vector<uint32_t> m_mtimes;
+    std::vector<uint32_t> m_atimes;
+    std::vector<uint32_t> m_long_names;
+    std::vector<uint32_t> m_short_names;
+    std::vector<char> m_names;
+
+    // Set by index_tree(). The children of a node are m_children[m_child_offsets[node]] up to
+    // m_children[m_child_offsets[node + 1]], in catalog order.
+    std::vector<uint32_t> m_depths;
+    std::vector<uint32_t> m_child_offsets;
+    std::vector<uint32_t> m_children;
+
+    uint32_t name_end(size_t offset) const {
+        return offset < m_long_names.size() ? m_long_names[offset] : m_names.size();
+    }
+
+public:
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    void reserve(size_t count, size_t names_size) {
+        m_flags.reserve(count);
+        m_parents.reserve(count);
+        m_file_sizes.reserve(count);
+        m_mtimes.reserve(count);
+        m_atimes.reserve(count);
+        m_long_names.reserve(count);
+        m_short_names.reserve(count);
+        m_names.reserve(names_size);
+    }
+
+    // Appends the entry, without a parent until one is set.
+    uint32_t add(const parsed_dir_entry_t &entry) {
+        m_flags.push_back((entry.is_dir ? IS_DIR : 0) | (entry.is_empty_dir ? IS_EMPTY_DIR : 0) |
+                          (entry.is_last_entry ? IS_LAST_ENTRY : 0) | (entry.is_dir_end ? IS_DIR_END : 0));
+        m_parents.push_back(NO_NODE);
+        m_file_sizes.push_back(entry.file_size);
+        m_mtimes.push_back(entry.m_datetime);
+        m_atimes.push_back(entry.a_datetime);
+
+        m_long_names.push_back(m_names.size());
+        m_names.insert(m_names.end(), entry.long_name.begin(), entry.long_name.end());
+        m_names.push_back(0);
+        m_short_names.push_back(m_names.size());
+        m_names.insert(m_names.end(), entry.short_name.begin(), entry.short_name.end());
+        m_names.push_back(0);
+        return m_flags.size() - 1;
+    }
+
+    // Makes room for count entries and names_size bytes of names at the end, to be filled in by place().
+    void grow(size_t count, size_t names_size) {
+        auto size = m_flags.size() + count;
+        m_flags.resize(size);
+        m_parents.resize(size, NO_NODE);
+        m_file_sizes.resize(size);
+        m_mtimes.resize(size);
+        m_atimes.resize(size);
+        m_long_names.resize(size);
+        m_short_names.resize(size);
+        m_names.resize(m_names.size() + names_size);
+    }
+
+    // Copies the entries of a catalog whose tree is not built yet to the given node and offset of the names.
+    void place(const Catalog &part, size_t node, size_t names_offset) {
+        std::copy(part.m_flags.begin(), part.m_flags.end(), m_flags.begin() + node);
+        std::copy(part.m_parents.begin(), part.m_parents.end(), m_parents.begin() + node);
+        std::copy(part.m_file_sizes.begin(), part.m_file_sizes.end(), m_file_sizes.begin() + node);
+        std::copy(part.m_mtimes.begin(), part.m_mtimes.end(), m_mtimes.begin() + node);
+        std::copy(part.m_atimes.begin(), part.m_atimes.end(), m_atimes.begin() + node);
+        std::copy(part.m_names.begin(), part.m_names.end(), m_names.begin() + names_offset);
+        for (size_t i = 0; i < part.size(); ++i) {
+            m_long_names[node + i] = part.m_long_names[i] + names_offset;
+            m_short_names[node + i] = part.m_short_names[i] + names_offset;
         }
+    }
+
+    size_t size() const {
+        return m_flags.size();
+    }
+
+    size_t names_size() const {
+        return m_names.size();
+    }
+
+    bool is_dir(uint32_t node) const {
+        return m_flags[node] & IS_DIR;
+    }
 
-        std::stringstream ss;
-        auto i = items.size();
-        for (auto it = items.rbegin(); it != items.rend(); ++it, i--) {
-            ss << "/" << *it;
+    bool is_empty_dir(uint32_t node) const {
+        return m_flags[node] & IS_EMPTY_DIR;
+    }
+
+    bool is_last_entry(uint32_t node) const {
+        return m_flags[node] & IS_LAST_ENTRY;
+    }
+
+    bool is_dir_end(uint32_t node) const {
+        return m_flags[node] & IS_DIR_END;
+    }
+
+    uint32_t parent(uint32_t node) const {
+        return m_parents[node];
+    }
+
+    void set_parent(uint32_t node, uint32_t parent) {
+        m_parents[node] = parent;
+    }
+
+    uint32_t file_size(uint32_t node) const {
+        return m_file_sizes[node];
+    }
+
+    // Raw QIC times.
+    uint32_t mtime(uint32_t node) const {
+        return m_mtimes[node];
+    }
+
+    uint32_t atime(uint32_t node) const {
+        return m_atimes[node];
+    }
+
+    // Builds the children index and the depths from the parents, which come before their children.
+    void index_tree() {
+        auto count = size();
+        m_depths.assign(count, 0);
+
+        // Counted one slot further than the offsets, so that filling in the children with the offsets as cursors
+        // leaves each one at the start of its node.
+        m_child_offsets.assign(count + 2, 0);
+        for (uint32_t node = 0; node < count; ++node) {
+            auto parent = m_parents[node];
+            if (parent != NO_NODE) {
+                m_depths[node] = m_depths[parent] + 1;
+                ++m_child_offsets[parent + 2];
+            }
+        }
+
+        for (size_t node = 2; node < count + 2; ++node) {
+            m_child_offsets[node] += m_child_offsets[node - 1];
         }
 
-        return ss.str();
+        m_children.resize(m_child_offsets[count + 1]);
+        for (uint32_t node = 0; node < count; ++node) {
+            if (m_parents[node] != NO_NODE) {
+                m_children[m_child_offsets[m_parents[node] + 1]++] = node;
+            }
+        }
+        m_child_offsets.pop_back();
+    }
+
+    uint32_t depth(uint32_t node) const {
+        return m_depths[node];
+    }
+
+    uint32_t child_count(uint32_t node) const {
+        return m_child_offsets[node + 1] - m_child_offsets[node];
+    }
+
+    uint32_t child(uint32_t node, uint32_t index) const {
+        return m_children[m_child_offsets[node] + index];
+    }
+
+    std::string_view long_name(uint32_t node) const {
+        auto offset = m_long_names[node];
+        return std::string_view(m_names.data() + offset, m_short_names[node] - offset - 1);
     }
 
-    std::string get_native_path() const {
-        std::stringstream ss;
+    std::string_view short_name(uint32_t node) const {
+        auto offset = m_short_names[node];
+        return std::string_view(m_names.data() + offset, name_end(node + 1) - offset - 1);
+    }
 
-        auto native_path = qic_path;
-        std::replace(native_path.begin(), native_path.end(), '\n', '/');
+    std::string get_recursive_path(uint32_t node) const {
+        std::vector<std::string_view> items;
+        for (auto current = node; current != NO_NODE; current = m_parents[current]) {
+            items.push_back(long_name(current));
+        }
+
+        std::string path;
+        for (auto it = items.rbegin(); it != items.rend(); ++it) {
+            path += "/";
+            path += *it;
+        }
 
-        ss << "/" << native_path << "/" << long_name;
-        return ss.str();
+        return path;
     }
 };
 
@@ -85,34 +266,211 @@ struct recovered_file_entry_t {
     bool has_guessed_size = false;
     size_t guessed_size = 0;
     bool may_be_corrupted = false;
+    // Set once the file was found in the catalog.
+    uint32_t catalog_node = Catalog::NO_NODE;
 
-    struct tm mtime = {0};
-    struct tm atime = {0};
+    // Converted once when the record is read.
+    time_t mtime = 0;
+    time_t atime = 0;
 };
 
+// The data region follows the VTBL and the MDID.
+static const size_t DATA_OFFSET = 0x100;
+
+// A data segment as described by its cseg_head_t and cframe_head_t headers.
+struct segment_t {
+    // File offset of the segment data, past the headers.
+    size_t offset;
+    size_t size;
+    bool compressed;
+    // Cumulative uncompressed size at the end of the segment.
+    uint64_t cumulative_size;
+};
+
+
 using mdid_t = std::unordered_map<std::string, std::string>;
 mdid_t get_mdid(const MappedFile *f, size_t mdid_offset);
 
 bool decompress(const SafeArray *in, std::vector<uint8_t> &out);
+bool decompress(const SafeArray *in, uint8_t *out, size_t out_size, size_t *decompressed_size);
+
+bool read_segments(const MappedFile *file, size_t start_offset, std::vector<segment_t> &segments);
 
 bool read_catalog(const MappedFile *file, size_t start_offset, size_t size, std::vector<uint8_t> &buffer);
-bool read_data_segment(const MappedFile *file, size_t start_offset, std::vector<uint8_t> &buffer);
+bool read_data_segment(const MappedFile *file, size_t start_offset, std::vector<uint8_t> &buffer,
+                       ThreadPool *pool = nullptr, std::vector<segment_t> *decoded = nullptr,
+                       std::vector<size_t> *signatures = nullptr);
+
+// Appends the output of the given segments to buffer. When set, decoded receives the segments that were decoded,
+// with the cumulative sizes they actually produced, and signatures the offsets of DAT_SIG in the output, found as
+// it gets decoded.
+bool decode_segments(const MappedFile *file, const std::vector<segment_t> &segments, std::vector<uint8_t> &buffer,
+                     ThreadPool *pool = nullptr, std::vector<segment_t> *decoded = nullptr,
+                     std::vector<size_t> *signatures = nullptr);
 
-bool read_dir_entry(const SafeArray *buffer, size_t &offset, parsed_dir_entry_t &entry);
-bool read_dir_entries(const SafeArray *buffer, std::vector<parsed_dir_entry_t> &dirs);
-void reconstruct_tree(std::vector<parsed_dir_entry_t> &dirs);
+// Appends bytes [offset, offset + size) of the data region to buffer, decoding only the segments that hold them.
+// The cumulative sizes of the segments must be those they actually decode to.
+bool read_data_range(const MappedFile *file, const std::vector<segment_t> &segments, uint64_t offset, size_t size,
+                     std::vector<uint8_t> &buffer, ThreadPool *pool = nullptr);
 
-bool recover_files(const SafeArray *file_data, std::vector<recovered_file_entry_t> &recovered_files);
+// Part of the archive file holding bytes of the data region verbatim.
+struct file_extent_t {
+    size_t offset;
+    size_t size;
+};
+
+// Finds where bytes [offset, offset + size) of the data region lie in the archive, provided that they are all in
+// raw segments. The cumulative sizes of the segments must be those they actually decode to.
+bool get_raw_extents(const std::vector<segment_t> &segments, uint64_t offset, size_t size,
+                     std::vector<file_extent_t> &extents);
+
+// Writes the extents of the archive to fd, copying within the kernel when the file systems allow it.
+bool copy_extents(const MappedFile *archive, const std::vector<file_extent_t> &extents, int fd);
+
+// Receives decoded data, in the order of the data region.
+using data_chunk_callback_t = std::function<void(const uint8_t *data, size_t size)>;
+
+// Decodes the data region one segment at a time, so that memory use does not grow with the archive size.
+bool read_data_stream(const MappedFile *file, size_t start_offset, const data_chunk_callback_t &callback);
+
+// Sidecar file that saves repeat runs from walking the segment headers and scanning the data region.
+struct archive_index_t {
+    size_t data_offset = 0;
+    // Whether all of the data region could be read.
+    bool complete = false;
+    std::vector<segment_t> segments;
+    std::vector<recovered_file_entry_t> files;
+};
+
+bool extract_indexed_file(const MappedFile *archive, const archive_index_t &index, const recovered_file_entry_t *entry,
+                          ThreadPool *pool = nullptr);
+
+bool load_index(const std::string &index_path, const MappedFile *archive, archive_index_t &index);
+bool save_index(const std::string &index_path, const MappedFile *archive, const archive_index_t &index);
+
+bool read_dir_entry(const SafeArray *buffer, size_t &offset, parsed_dir_entry_t &entry, StringArena &names);
+
+// Parses the catalog. Entries are found first, then decoded in parallel with a pool. Their columns and name pool
+// are sized up front, so that parsing allocates a fixed number of times however many entries there are.
+bool read_dir_entries(const SafeArray *buffer, Catalog &catalog, ThreadPool *pool = nullptr);
+// Sets the parents of the entries from their order in the catalog, and indexes the tree.
+void reconstruct_tree(Catalog &catalog);
+
+// Finds the file records in the data region. With a pool, the data is scanned in chunks in parallel. Scanning is
+// skipped when the offsets of DAT_SIG are already known.
+bool recover_files(const SafeArray *file_data, std::vector<recovered_file_entry_t> &recovered_files,
+                   ThreadPool *pool = nullptr, const std::vector<size_t> *signatures = nullptr);
 bool extract_file(const SafeArray *file_data, const recovered_file_entry_t *entry);
-bool update_times_for_dirs(const std::vector<parsed_dir_entry_t> &parsed_entries);
 
-std::vector<size_t> search_binary_substring(const uint8_t *haystack, size_t haystack_size, const uint8_t *needle,
-                                            size_t needle_size);
+// Archive the data region was decoded from, along with its decoded segments.
+struct raw_source_t {
+    const MappedFile *archive;
+    const std::vector<segment_t> *segments;
+};
 
-std::string utf16_to_utf8(const void *buffer, size_t size_in_bytes);
+// Extracts the files concurrently on the pool, or through io_uring when asked and available, with the same result
+// as extracting them in order. Files found in the catalog are created in the directories of their nodes. Given the
+// raw source, files stored in raw segments are copied from the archive rather than from file_data. The files are
+// written below root. Returns the number of files that could not be extracted.
+int extract_files(const SafeArray *file_data, const std::vector<recovered_file_entry_t> &entries,
+                  const Catalog *catalog, ThreadPool *pool, bool use_uring = false, const raw_source_t *raw = nullptr,
+                  const std::string &root = ".");
+
+// Settles the size to extract for a recovered file that differs from its catalog entry, counting it as an error.
+void reconcile_with_catalog(const Catalog &catalog, uint32_t node, recovered_file_entry_t &entry, int &error_count);
+
+struct recovery_stats_t {
+    size_t occurrence_count = 0;
+    size_t recovered_count = 0;
+    size_t total_size = 0;
+    int error_count = 0;
+};
+
+// Recovers and extracts files while streaming the data region, holding only a small window of it in memory.
+bool recover_files_streaming(const MappedFile *file, size_t start_offset, const PathTable &paths,
+                             recovery_stats_t &stats);
+
+// Reads the catalog at the end of the archive and rebuilds its tree. Returns 0, or the exit code of the step
+// that failed.
+int read_archive_catalog(const MappedFile *file, ThreadPool *pool, Catalog &catalog);
+
+// Decodes the whole data region in memory, then recovers the files it holds and extracts them below root. Each
+// recovered file is printed when verbose.
+void recover_archive(const std::string &path, const MappedFile *file, const PathTable &paths, ThreadPool *pool,
+                     ThreadPool *writers, bool use_uring, bool use_index, const std::string &root, bool verbose,
+                     recovery_stats_t &stats);
+
+int get_file_count(const Catalog &catalog);
+
+// The archives named directly, followed by the .qic files of the directories named, in the order of their names.
+bool find_archives(const std::vector<std::string> &inputs, std::vector<std::string> &archives);
+
+// Each archive is extracted in a directory of the output named after it. Archives with the same name get a
+// number appended.
+std::vector<std::string> get_output_roots(const std::string &output, const std::vector<std::string> &archives);
+
+// Recovers many archives at once on the shared pools. Each archive is driven by its own thread, which decodes on
+// the pool and writes on the writers, so that the serial parts of one archive overlap with the parallel parts of
+// the others. The memory budget bounds how many archives are decoded at the same time. Diagnostics are prefixed
+// with the name of their archive. Returns 0, or -11 if any archive failed.
+int run_batch(const std::vector<std::string> &inputs, const std::string &output, ThreadPool *pool,
+              ThreadPool *writers, bool use_uring, bool use_index, uint64_t memory_limit);
+
+enum list_format_t { LIST_TEXT, LIST_JSON, LIST_CSV };
+
+// Writes the tree of the catalog to fd depth first, one entry per line, and returns false if writing failed. Times
+// are listed as recorded, in the local time of the backup. They differ from the times given to extracted files,
+// which keep the quirks of the original conversion in get_time and end up about a month later.
+bool list_catalog(const Catalog &catalog, list_format_t format, int fd);
+
+// Sets the times of the directories of the catalog below root, creating those that are missing. With a pool, the
+// directories at the same depth are updated in parallel.
+bool update_times_for_dirs(const PathTable &paths, ThreadPool *pool = nullptr, const std::string &root = ".");
+
+enum signature_type_t : uint8_t { SIG_DAT, SIG_EDAT, SIG_VTBL, SIG_MDID, SIG_COUNT };
+
+struct signature_hit_t {
+    size_t offset;
+    signature_type_t type;
+};
+
+enum simd_level_t { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 };
+
+// The best instruction set the CPU supports for scanning.
+simd_level_t get_simd_level();
+
+// Finds the signatures whose bit (1 << type) is set in mask, in one pass, and appends them in offset order. The
+// level only matters for testing, the best one the CPU supports is used by default.
+void find_signatures(const uint8_t *data, size_t size, unsigned mask, std::vector<signature_hit_t> &hits,
+                     simd_level_t level = get_simd_level());
+
+// Converts UTF-16LE to UTF-8 into out, which must have room for three bytes per code unit. Returns the size of the
+// output, or -1 when the input is not valid UTF-16. A high surrogate at the end is dropped.
+ssize_t utf16_to_utf8(const void *buffer, size_t size_in_bytes, char *out);
+
+// Converts into the arena, giving an empty name for invalid input.
+std::string_view utf16_to_utf8(const void *buffer, size_t size_in_bytes, StringArena &arena);
+
+// Offsets from UTC of the local standard time of each day, as mktime has them for the time zone in effect, which
+// may have changed over the years. Days are looked up once, from any thread.
+class LocalOffsets {
+    std::unique_ptr<std::atomic<int64_t>[]> m_offsets;
+
+public:
+    LocalOffsets();
+
+    // Seconds west of UTC of a local standard time given in seconds since the epoch.
+    long get(time_t local);
+};
 
-struct tm get_time(unsigned long date);
-bool update_timestamps(const char *filepath, const struct tm *mtime, const struct tm *atime);
+// Converts a QIC time to a time_t, the time being local standard time, seconds_west of UTC as in timezone or as
+// given by the offsets. The offsets default to those of the local time zone.
+time_t get_time(unsigned long date);
+time_t get_time(unsigned long date, LocalOffsets &offsets);
+time_t get_time(unsigned long date, long seconds_west);
+bool update_timestamps(const char *filepath, time_t mtime, time_t atime);
+bool update_timestamps(int fd, time_t mtime, time_t atime);
+bool update_timestamps(int dir_fd, const char *name, time_t mtime, time_t atime);
 bool create_dir_tree(const fs::path &dir_path);
 
 #endif
\ No newline at end of file
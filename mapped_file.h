@@ -23,13 +23,17 @@
 #ifndef _MAPPED_FILE_
 #define _MAPPED_FILE_
 
+#include <cstring>
+#include <errno.h>
 #include <fcntl.h>
 #include <memory>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "log_prefix.h"
 
 class SafeArray {
 protected:
@@ -91,16 +95,20 @@ public:
         }
     }
 
+    int fd() const {
+        return m_fd;
+    }
+
     static std::shared_ptr<MappedFile> create(const std::string &filePath) {
         int fd = open(filePath.c_str(), O_RDONLY);
         if (fd == -1) {
-            perror("Error opening file");
+            fprintf(stderr, "%sError opening file: %s\n", t_log_prefix, strerror(errno));
             return nullptr;
         }
 
         struct stat file_stat;
         if (fstat(fd, &file_stat) == -1) {
-            perror("Error getting file size");
+            fprintf(stderr, "%sError getting file size: %s\n", t_log_prefix, strerror(errno));
             close(fd);
             return nullptr;
         }
@@ -108,7 +116,7 @@ public:
         size_t size = file_stat.st_size;
         uint8_t *buffer = static_cast<uint8_t *>(mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
         if (buffer == MAP_FAILED) {
-            perror("Error mapping file to memory");
+            fprintf(stderr, "%sError mapping file to memory: %s\n", t_log_prefix, strerror(errno));
             close(fd);
             return nullptr;
         }
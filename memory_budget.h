@@ -0,0 +1,61 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#ifndef _MEMORY_BUDGET_H_
+#define _MEMORY_BUDGET_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Bounds the memory held by work running at the same time. acquire() waits until the requested amount fits in
+// what is left. A request larger than the whole budget waits until nothing else holds memory, then runs alone.
+class MemoryBudget {
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    uint64_t m_limit;
+    uint64_t m_used;
+
+public:
+    MemoryBudget(uint64_t limit) : m_limit(limit), m_used(0) {
+    }
+
+    uint64_t limit() const {
+        return m_limit;
+    }
+
+    void acquire(uint64_t size) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_cv.wait(lock, [&] { return m_used == 0 || m_used + size <= m_limit; });
+        m_used += size;
+    }
+
+    void release(uint64_t size) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_used -= size;
+        }
+        m_cv.notify_all();
+    }
+};
+
+#endif
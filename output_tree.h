@@ -0,0 +1,203 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#ifndef _OUTPUT_TREE_H_
+#define _OUTPUT_TREE_H_
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "main.h"
+
+// File descriptor of a directory of the output tree. Cached ones are owned by the tree.
+class DirFd {
+    int m_fd;
+    bool m_owned;
+
+public:
+    DirFd(int fd, bool owned) : m_fd(fd), m_owned(owned) {
+    }
+
+    DirFd(DirFd &&other) : m_fd(other.m_fd), m_owned(other.m_owned) {
+        other.m_owned = false;
+    }
+
+    DirFd(const DirFd &) = delete;
+    DirFd &operator=(const DirFd &) = delete;
+
+    ~DirFd() {
+        if (m_owned) {
+            close(m_fd);
+        }
+    }
+
+    int get() const {
+        return m_fd;
+    }
+
+    // Leaves the descriptor open for good.
+    void release() {
+        m_owned = false;
+    }
+};
+
+// Creates the directories of the output tree and keeps them open, keyed by their catalog node, so that files
+// get created relative to their parent directory instead of resolving their whole path each time. Each
+// directory is created once. Past the number of descriptors the process may keep open, which all the trees share,
+// directories are opened for each use instead.
+class OutputTree {
+    // Descriptors left for the files being written and everything else.
+    static const rlim_t RESERVED_FDS = 256;
+
+    // Descriptors cached by all trees, several of which may extract at the same time, and the most they may cache.
+    // The limit is lowered when the process runs out of descriptors anyway.
+    static inline std::atomic<size_t> s_cached = 0;
+    static inline std::atomic<size_t> s_max_cached = SIZE_MAX;
+
+    const Catalog &m_catalog;
+    int m_root_fd;
+    std::mutex m_lock;
+    std::unordered_map<uint32_t, int> m_fds;
+
+    OutputTree(const Catalog &catalog, int root_fd) : m_catalog(catalog), m_root_fd(root_fd) {
+    }
+
+    // Deep trees need many descriptors, the soft limit is often much lower than the hard one. It is raised once.
+    static size_t get_fd_limit() {
+        static const size_t max_cached = [] {
+            struct rlimit limit;
+            if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+                return (size_t) 0;
+            }
+
+            if (limit.rlim_cur < limit.rlim_max) {
+                limit.rlim_cur = limit.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &limit);
+                getrlimit(RLIMIT_NOFILE, &limit);
+            }
+
+            if (limit.rlim_cur == RLIM_INFINITY) {
+                return SIZE_MAX;
+            }
+            return limit.rlim_cur > RESERVED_FDS ? (size_t) (limit.rlim_cur - RESERVED_FDS) : 0;
+        }();
+        return max_cached;
+    }
+
+    static bool reserve_cached() {
+        if (s_cached++ < std::min(get_fd_limit(), s_max_cached.load())) {
+            return true;
+        }
+        --s_cached;
+        return false;
+    }
+
+    DirFd open_child(const DirFd &parent, uint32_t node) {
+        auto name = m_catalog.long_name(node).data();
+        if (mkdirat(parent.get(), name, 0777) < 0 && errno != EEXIST) {
+            return DirFd(-1, false);
+        }
+
+        // Other threads may use the cached descriptors, so running out of them only stops caching more.
+        auto fd = openat(parent.get(), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 && errno == EMFILE) {
+            s_max_cached = s_cached.load();
+        }
+
+        if (fd < 0 || !reserve_cached()) {
+            return DirFd(fd, fd >= 0);
+        }
+
+        m_fds[node] = fd;
+        return DirFd(fd, false);
+    }
+
+    DirFd get_dir_locked(uint32_t node) {
+        // Like in paths, the root and other nameless directories add no level.
+        while (node != Catalog::NO_NODE && m_catalog.long_name(node).empty()) {
+            node = m_catalog.parent(node);
+        }
+
+        if (node == Catalog::NO_NODE) {
+            return DirFd(m_root_fd, false);
+        }
+
+        auto it = m_fds.find(node);
+        if (it != m_fds.end()) {
+            return DirFd(it->second, false);
+        }
+
+        auto parent = get_dir_locked(m_catalog.parent(node));
+        if (parent.get() < 0) {
+            return DirFd(-1, false);
+        }
+
+        return open_child(parent, node);
+    }
+
+public:
+    ~OutputTree() {
+        for (auto &it : m_fds) {
+            close(it.second);
+        }
+        s_cached -= m_fds.size();
+        close(m_root_fd);
+    }
+
+    // The catalog must outlive the tree.
+    static std::shared_ptr<OutputTree> create(const std::string &root, const Catalog &catalog) {
+        if (!create_dir_tree(root)) {
+            return nullptr;
+        }
+
+        auto fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        // The limit is raised before the first directories get opened.
+        get_fd_limit();
+        return std::shared_ptr<OutputTree>(new OutputTree(catalog, fd));
+    }
+
+    // Returns the directory of the given catalog node, creating it and its parents as needed, or -1 if that
+    // fails. Holding the returned descriptor does not block other threads.
+    DirFd get_dir(uint32_t node) {
+        std::lock_guard<std::mutex> guard(m_lock);
+        return get_dir_locked(node);
+    }
+
+    // Returns the directory that holds the given catalog node.
+    DirFd get_parent_dir(uint32_t node) {
+        return get_dir(m_catalog.parent(node));
+    }
+};
+
+#endif
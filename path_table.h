@@ -0,0 +1,133 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#ifndef _PATH_TABLE_H_
+#define _PATH_TABLE_H_
+
+#include <string_view>
+#include <vector>
+
+#include "main.h"
+
+// Looks up catalog entries by path without building path strings. Each distinct path is interned once, keyed by
+// the id of its parent path and its name, so that entries with the same path share an id and the last of them is
+// the one found, as with a map from full paths. Lookups walk the components of the path from the root.
+class PathTable {
+    static constexpr uint32_t NO_PATH = UINT32_MAX;
+
+    struct path_t {
+        uint32_t parent;
+        std::string_view name;
+        uint32_t node;
+    };
+
+    const Catalog &m_catalog;
+    std::vector<path_t> m_paths;
+
+    // Open addressing on (parent id, name hash), holding path ids.
+    std::vector<uint32_t> m_slots;
+    size_t m_mask;
+
+    static uint64_t hash(uint32_t parent, std::string_view name) {
+        uint64_t h = 0xcbf29ce484222325ull ^ parent;
+        for (auto c : name) {
+            h = (h ^ (uint8_t) c) * 0x100000001b3ull;
+        }
+        return h ^ (h >> 29);
+    }
+
+    // Returns the slot that holds the path, or the empty one where it would go.
+    size_t find_slot(uint32_t parent, std::string_view name) const {
+        for (auto slot = hash(parent, name) & m_mask;; slot = (slot + 1) & m_mask) {
+            auto id = m_slots[slot];
+            if (id == NO_PATH || (m_paths[id].parent == parent && m_paths[id].name == name)) {
+                return slot;
+            }
+        }
+    }
+
+    uint32_t intern(uint32_t parent, std::string_view name) {
+        auto slot = find_slot(parent, name);
+        if (m_slots[slot] == NO_PATH) {
+            m_slots[slot] = m_paths.size();
+            m_paths.push_back({parent, name, Catalog::NO_NODE});
+        }
+        return m_slots[slot];
+    }
+
+public:
+    // The catalog must outlive the table.
+    PathTable(const Catalog &catalog) : m_catalog(catalog) {
+        size_t size = 16;
+        while (size < catalog.size() * 2) {
+            size *= 2;
+        }
+        m_slots.assign(size, NO_PATH);
+        m_mask = size - 1;
+        m_paths.reserve(catalog.size());
+
+        // Parents come before their children in the catalog, but the ids of all the nodes are kept in case not.
+        std::vector<uint32_t> ids(catalog.size(), NO_PATH);
+        std::vector<uint32_t> chain;
+        for (uint32_t i = 0; i < catalog.size(); ++i) {
+            for (auto j = i; j != Catalog::NO_NODE && ids[j] == NO_PATH; j = catalog.parent(j)) {
+                chain.push_back(j);
+            }
+
+            for (; !chain.empty(); chain.pop_back()) {
+                auto node = chain.back();
+                auto parent = catalog.parent(node);
+                ids[node] = intern(parent == Catalog::NO_NODE ? NO_PATH : ids[parent], catalog.long_name(node));
+            }
+
+            m_paths[ids[i]].node = i;
+        }
+    }
+
+    const Catalog &catalog() const {
+        return m_catalog;
+    }
+
+    // Finds the node whose get_recursive_path() is path, NO_NODE if there is none.
+    uint32_t find(std::string_view path) const {
+        if (path.empty() || path[0] != '/') {
+            return Catalog::NO_NODE;
+        }
+
+        auto id = NO_PATH;
+        size_t start = 1;
+        while (true) {
+            auto end = std::min(path.find('/', start), path.size());
+            auto slot = find_slot(id, path.substr(start, end - start));
+            id = m_slots[slot];
+            if (id == NO_PATH) {
+                return Catalog::NO_NODE;
+            }
+            if (end == path.size()) {
+                return m_paths[id].node;
+            }
+            start = end + 1;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,98 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+
+#ifndef _RECORD_SCANNER_H_
+#define _RECORD_SCANNER_H_
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "main.h"
+
+// Finds file records in a data region fed chunk by chunk, with the same results as recover_files on the whole
+// region, and hands out the data of each file as it streams past. Only the bytes that may still be needed are
+// kept: the tail that could hold the start of a signature, and a record whose header is not complete yet.
+class RecordScanner {
+public:
+    // Called with a new file, returns whether its data is wanted.
+    using begin_t = std::function<bool(const recovered_file_entry_t &entry)>;
+    using data_t = std::function<void(const uint8_t *data, size_t size)>;
+    // Called once the end of the file is known, with its guessed size set.
+    using end_t = std::function<void(const recovered_file_entry_t &entry)>;
+
+private:
+    begin_t m_begin;
+    data_t m_data;
+    end_t m_end;
+
+    // Bytes of the stream from m_window_offset on.
+    std::vector<uint8_t> m_window;
+    size_t m_window_offset;
+
+    // Signatures were searched at every offset below this one.
+    size_t m_scanned;
+
+    // Signature offsets whose record was not read yet.
+    std::deque<size_t> m_pending;
+    size_t m_occurrence_count;
+
+    // Names of the record being read.
+    StringArena m_names;
+
+    bool m_stopped;
+
+    // The file whose data is streaming, and the offset up to which it was handed out.
+    bool m_in_file;
+    bool m_file_wanted;
+    recovered_file_entry_t m_file;
+    size_t m_file_written;
+
+    size_t end_offset() const {
+        return m_window_offset + m_window.size();
+    }
+
+    void write_file_data(size_t end);
+    void end_file(bool has_next, size_t next_offset);
+    void process(bool at_end);
+
+public:
+    RecordScanner(begin_t begin, data_t data, end_t end)
+        : m_begin(begin), m_data(data), m_end(end), m_window_offset(0), m_scanned(0), m_occurrence_count(0),
+          m_stopped(false), m_in_file(false), m_file_wanted(false), m_file_written(0) {
+    }
+
+    // Returns false once scanning stopped on a record that runs past the end of the data.
+    bool feed(const uint8_t *data, size_t size);
+    bool finish();
+
+    size_t occurrence_count() const {
+        return m_occurrence_count;
+    }
+
+    size_t size() const {
+        return end_offset();
+    }
+};
+
+#endif
@@ -21,11 +21,20 @@
 ///
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <optional>
 #include <stdio.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
+#include "io_uring.h"
 #include "main.h"
+#include "output_tree.h"
+#include "path_table.h"
 #include "qic.h"
+#include "record_scanner.h"
+#include "thread_pool.h"
 
 static bool check_sig(const SafeArray *file_data, size_t offset, uint32_t sig) {
     auto dat_sig = file_data->get<uint32_t>(offset);
@@ -36,169 +45,857 @@ static bool check_sig(const SafeArray *file_data, size_t offset, uint32_t sig) {
     return *dat_sig == sig;
 }
 
-static std::string get_native_path(uint16_t *data, size_t char_count) {
-    std::vector<uint16_t> path;
-    for (int i = 0; i < char_count; ++i) {
-        if (data[i] < ' ') {
-            path.push_back('/');
-        } else {
-            path.push_back(data[i]);
-        }
+enum record_status_t {
+    // The directory entry runs past the end of the data.
+    RECORD_TRUNCATED,
+    // The data ends before the EDAT_SIG that would follow the path.
+    RECORD_INCOMPLETE,
+    RECORD_NOT_A_FILE,
+    RECORD_FILE,
+};
+
+// Checks the structure of the record whose DAT_SIG is at offset without decoding any of its strings, which most
+// false positives fail. Gives the same status as read_file_record.
+static record_status_t check_file_record(const SafeArray *file_data, size_t offset) {
+    offset += sizeof(uint32_t);
+
+    auto d1 = file_data->get<ms_dir_fixed_t>(offset);
+    if (!d1) {
+        return RECORD_TRUNCATED;
+    }
+
+    offset += sizeof(ms_dir_fixed_t) + d1->nm_len;
+
+    auto d2 = file_data->get<ms_dir_fixed2_t>(offset);
+    if (!d2) {
+        return RECORD_TRUNCATED;
+    }
+
+    offset += sizeof(ms_dir_fixed2_t);
+
+    auto dos_len = d2->nm_len ? d2->nm_len : d1->nm_len;
+    if (!file_data->get(offset, dos_len)) {
+        return RECORD_TRUNCATED;
     }
 
-    return utf16_to_utf8(path.data(), char_count * sizeof(*data));
+    offset += dos_len;
+
+    if (d1->flag & SUBDIR) {
+        return RECORD_NOT_A_FILE;
+    }
+
+    if (!check_sig(file_data, offset + d1->path_len, EDAT_SIG)) {
+        auto edat_end = offset + d1->path_len + sizeof(uint32_t);
+        return edat_end > file_data->size() ? RECORD_INCOMPLETE : RECORD_NOT_A_FILE;
+    }
+
+    return RECORD_FILE;
 }
 
-bool recover_files(const SafeArray *file_data, std::vector<recovered_file_entry_t> &recovered_files) {
-    uint32_t dat_sig = DAT_SIG;
-    auto occurrences =
-        search_binary_substring(file_data->buffer(), file_data->size(), (uint8_t *) &dat_sig, sizeof(uint32_t));
-    printf("Found %d occurrences in data of size=%d\n", occurrences.size(), file_data->size());
+// Reads the file record whose DAT_SIG is at offset, decoding its names into the arena.
+static record_status_t read_file_record(const SafeArray *file_data, size_t offset, recovered_file_entry_t &entry,
+                                        StringArena &names) {
+    auto status = check_file_record(file_data, offset);
+    if (status != RECORD_FILE) {
+        return status;
+    }
 
-    for (auto i = 0; i < occurrences.size(); ++i) {
-        auto offset = occurrences[i];
+    offset += sizeof(uint32_t);
 
-        if (!check_sig(file_data, offset, DAT_SIG)) {
-            return false;
+    parsed_dir_entry_t dir_entry;
+    if (!read_dir_entry(file_data, offset, dir_entry, names)) {
+        return RECORD_TRUNCATED;
+    }
+
+    // We have a file with high probability, attempt recovery.
+    std::string_view qic_path;
+    if (dir_entry.path_len > 0) {
+        auto path_ptr = file_data->get(offset, dir_entry.path_len);
+        if (!path_ptr) {
+            return RECORD_NOT_A_FILE;
         }
 
-        offset += sizeof(uint32_t);
+        qic_path = utf16_to_utf8(path_ptr, dir_entry.path_len & ~1, names);
+        offset += dir_entry.path_len;
+    }
 
-        parsed_dir_entry_t dir_entry;
-        if (!read_dir_entry(file_data, offset, dir_entry)) {
-            fprintf(stderr, "Could not read directory entry");
-            return false;
-        }
+    // Skip EDAT_SIG and the following word.
+    offset += sizeof(uint32_t) + 2;
+
+    // Path components are separated by control characters, which remain single bytes in UTF-8.
+    entry.path = "/";
+    entry.path += qic_path;
+    std::replace_if(entry.path.begin(), entry.path.end(), [](char c) { return (uint8_t) c < ' '; }, '/');
+    entry.path += "/";
+    entry.path += dir_entry.long_name;
+
+    entry.offset = offset;
+    entry.has_guessed_size = false;
+    entry.guessed_size = 0;
+    entry.mtime = get_time(dir_entry.m_datetime);
+    entry.atime = get_time(dir_entry.a_datetime);
+    return RECORD_FILE;
+}
 
-        if (dir_entry.is_dir) {
-            continue;
+// Signatures found in one chunk of the data and the file records they start.
+struct scan_chunk_t {
+    std::vector<size_t> hits;
+    // Index in hits of each file record.
+    std::vector<std::pair<size_t, recovered_file_entry_t>> files;
+    // Index in hits of the first record that runs past the end of the data, records are not read past it.
+    size_t truncated_at = SIZE_MAX;
+};
+
+static void read_chunk_records(const SafeArray *file_data, scan_chunk_t &chunk) {
+    StringArena names;
+    for (size_t i = 0; i < chunk.hits.size(); ++i) {
+        recovered_file_entry_t entry;
+        names.clear();
+        auto status = read_file_record(file_data, chunk.hits[i], entry, names);
+        if (status == RECORD_TRUNCATED) {
+            chunk.truncated_at = i;
+            return;
         }
 
-        if (!check_sig(file_data, offset + dir_entry.path_len, EDAT_SIG)) {
-            continue;
+        if (status == RECORD_FILE) {
+            chunk.files.emplace_back(i, std::move(entry));
         }
+    }
+}
 
-        // We have a file with high probability, attempt recovery.
-        if (dir_entry.path_len > 0) {
-            auto path_ptr = file_data->get(offset, dir_entry.path_len);
-            if (!path_ptr) {
-                continue;
-            }
+static void scan_chunk(const SafeArray *file_data, size_t start, size_t end, scan_chunk_t &chunk) {
+    // Signatures starting up to the end of the chunk may extend 3 bytes into the next one.
+    auto scan_end = std::min(end + sizeof(uint32_t) - 1, file_data->size());
+    std::vector<signature_hit_t> hits;
+    find_signatures(file_data->buffer() + start, scan_end - start, 1 << SIG_DAT, hits);
+    for (const auto &hit : hits) {
+        chunk.hits.push_back(start + hit.offset);
+    }
 
-            dir_entry.qic_path = get_native_path((uint16_t *) path_ptr, dir_entry.path_len / 2);
-            offset += dir_entry.path_len;
+    read_chunk_records(file_data, chunk);
+}
+
+// Each thread gets a few chunks, so that one with many false positives does not hold back the others.
+static const size_t MIN_SCAN_CHUNK_SIZE = 64 * 1024;
+static const size_t MIN_SIGNATURE_CHUNK_SIZE = 1024;
+static const size_t SCAN_CHUNKS_PER_THREAD = 4;
+
+bool recover_files(const SafeArray *file_data, std::vector<recovered_file_entry_t> &recovered_files, ThreadPool *pool,
+                   const std::vector<size_t> *signatures) {
+    auto parallel = pool && pool->size() > 1;
+    auto size = signatures ? signatures->size() : file_data->size();
+    size_t chunk_size = size;
+    if (parallel) {
+        chunk_size = std::max(size / (pool->size() * SCAN_CHUNKS_PER_THREAD),
+                              signatures ? MIN_SIGNATURE_CHUNK_SIZE : MIN_SCAN_CHUNK_SIZE);
+    }
+
+    // Chunks are ranges of the data, or of the signatures when these are known.
+    std::vector<scan_chunk_t> chunks(chunk_size ? (size + chunk_size - 1) / chunk_size : 0);
+    auto scan = [&](size_t i) {
+        auto start = i * chunk_size;
+        auto end = std::min(start + chunk_size, size);
+        if (signatures) {
+            chunks[i].hits.assign(signatures->begin() + start, signatures->begin() + end);
+            read_chunk_records(file_data, chunks[i]);
+        } else {
+            scan_chunk(file_data, start, end, chunks[i]);
         }
+    };
 
-        // Skip EDAT_SIG and the following word.
-        offset += sizeof(uint32_t) + 2;
+    if (chunks.size() > 1) {
+        pool->parallel_for(chunks.size(), scan);
+    } else if (!chunks.empty()) {
+        scan(0);
+    }
 
-        recovered_file_entry_t entry;
-        entry.path = dir_entry.get_native_path();
-        entry.offset = offset;
-        entry.has_guessed_size = false;
-        entry.guessed_size = 0;
-        entry.mtime = dir_entry.mtime;
-        entry.atime = dir_entry.atime;
-
-        if (i < occurrences.size() - 1) {
-            auto next_offset = occurrences[i + 1];
-            if (check_sig(file_data, next_offset, DAT_SIG)) {
-                entry.guessed_size = next_offset - offset;
+    std::vector<size_t> occurrences;
+    for (const auto &chunk : chunks) {
+        occurrences.insert(occurrences.end(), chunk.hits.begin(), chunk.hits.end());
+    }
+
+    printf("%sFound %zu occurrences in data of size=%zu\n", t_log_prefix, occurrences.size(), file_data->size());
+
+    // The size of each file is guessed from the next signature, wherever it is.
+    size_t base = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        for (auto &file : chunks[i].files) {
+            auto &entry = file.second;
+            auto next = base + file.first + 1;
+            if (next < occurrences.size()) {
+                entry.guessed_size = occurrences[next] - entry.offset;
                 entry.has_guessed_size = true;
             }
+
+            recovered_files.push_back(std::move(entry));
+        }
+
+        if (chunks[i].truncated_at != SIZE_MAX) {
+            fprintf(stderr, "%sCould not read directory entry", t_log_prefix);
+            return false;
         }
 
-        recovered_files.push_back(entry);
+        base += chunks[i].hits.size();
     }
 
     return true;
 }
 
-bool extract_file(const SafeArray *file_data, const recovered_file_entry_t *entry) {
-    auto buffer = file_data->get(entry->offset, entry->guessed_size);
-    if (!buffer) {
+bool RecordScanner::feed(const uint8_t *data, size_t size) {
+    if (m_stopped) {
         return false;
     }
 
+    m_window.insert(m_window.end(), data, data + size);
+
+    // Signatures may straddle chunks, search from the first offset not searched yet.
+    auto end = end_offset();
+    if (end >= sizeof(uint32_t)) {
+        auto from = m_scanned - m_window_offset;
+        std::vector<signature_hit_t> hits;
+        find_signatures(m_window.data() + from, m_window.size() - from, 1 << SIG_DAT, hits);
+        for (auto hit : hits) {
+            m_pending.push_back(m_scanned + hit.offset);
+        }
+
+        m_occurrence_count += hits.size();
+        m_scanned = end - sizeof(uint32_t) + 1;
+    }
+
+    process(false);
+    return !m_stopped;
+}
+
+bool RecordScanner::finish() {
+    if (!m_stopped) {
+        process(true);
+    }
+
+    if (m_in_file) {
+        end_file(false, 0);
+    }
+
+    return !m_stopped;
+}
+
+void RecordScanner::write_file_data(size_t end) {
+    if (end <= m_file_written) {
+        return;
+    }
+
+    if (m_file_wanted) {
+        m_data(&m_window[m_file_written - m_window_offset], end - m_file_written);
+    }
+    m_file_written = end;
+}
+
+void RecordScanner::end_file(bool has_next, size_t next_offset) {
+    write_file_data(has_next ? next_offset : end_offset());
+
+    m_file.has_guessed_size = has_next;
+    m_file.guessed_size = has_next ? next_offset - m_file.offset : 0;
+    m_in_file = false;
+    m_end(m_file);
+}
+
+void RecordScanner::process(bool at_end) {
+    while (!m_pending.empty()) {
+        auto offset = m_pending.front();
+
+        // The next signature ends the data of the current file, whatever follows it.
+        if (m_in_file) {
+            end_file(true, offset);
+        }
+
+        auto window = SafeArray::create(m_window.data(), m_window.size());
+        recovered_file_entry_t entry;
+        m_names.clear();
+        auto status = read_file_record(window.get(), offset - m_window_offset, entry, m_names);
+        if ((status == RECORD_TRUNCATED || status == RECORD_INCOMPLETE) && !at_end) {
+            // Wait for the rest of the record.
+            break;
+        }
+
+        m_pending.pop_front();
+
+        if (status == RECORD_TRUNCATED) {
+            fprintf(stderr, "%sCould not read directory entry", t_log_prefix);
+            m_pending.clear();
+            m_stopped = true;
+            return;
+        }
+
+        if (status != RECORD_FILE) {
+            continue;
+        }
+
+        entry.offset += m_window_offset;
+        m_file = entry;
+        m_file_written = entry.offset;
+        m_file_wanted = m_begin(m_file);
+        m_in_file = true;
+    }
+
+    // Past m_scanned, bytes may still turn out to start a signature.
+    if (m_in_file && m_pending.empty()) {
+        write_file_data(at_end ? end_offset() : std::min(m_scanned, end_offset()));
+    }
+
+    auto keep = m_scanned;
+    if (!m_pending.empty()) {
+        keep = std::min(keep, m_pending.front());
+    }
+    if (m_in_file) {
+        keep = std::min(keep, m_file_written);
+    }
+
+    if (keep > m_window_offset) {
+        m_window.erase(m_window.begin(), m_window.begin() + (keep - m_window_offset));
+        m_window_offset = keep;
+    }
+}
+
+static std::string get_output_path(const std::string &root, const recovered_file_entry_t *entry) {
     std::stringstream path;
-    path << "." << entry->path;
+    path << root << entry->path;
 
     if (entry->may_be_corrupted) {
         path << " [CORRUPTED]";
     }
 
-    auto path_str = path.str();
+    return path.str();
+}
 
+static FILE *create_output_file(const std::string &path_str) {
     fs::path fspath(path_str);
     fs::path dir_path = fspath.parent_path();
 
     if (!create_dir_tree(dir_path)) {
-        return false;
+        return nullptr;
+    }
+
+    return fopen(path_str.c_str(), "wb");
+}
+
+// Writes the data of the file to fd, copying it from the archive when it is stored there verbatim. Otherwise it
+// comes from buffer.
+static bool write_file_data(int fd, const uint8_t *buffer, const recovered_file_entry_t *entry,
+                            const raw_source_t *raw) {
+    std::vector<file_extent_t> extents;
+    if (raw && get_raw_extents(*raw->segments, entry->offset, entry->guessed_size, extents)) {
+        return copy_extents(raw->archive, extents, fd);
+    }
+
+    for (size_t written = 0; written < entry->guessed_size;) {
+        auto ret = write(fd, buffer + written, entry->guessed_size - written);
+        if (ret <= 0) {
+            return false;
+        }
+        written += ret;
     }
 
-    auto fp = fopen(path_str.c_str(), "wb");
+    return true;
+}
+
+static bool write_output_file(const uint8_t *buffer, const recovered_file_entry_t *entry, const raw_source_t *raw,
+                              const std::string &root) {
+    auto path_str = get_output_path(root, entry);
+    auto fp = create_output_file(path_str);
     if (!fp) {
         return false;
     }
 
-    if (fwrite(buffer, entry->guessed_size, 1, fp) != 1) {
+    // Nothing goes through the stream buffer, the data is written to the descriptor, whose times are set before
+    // it is closed.
+    auto ok = write_file_data(fileno(fp), buffer, entry, raw);
+    if (ok && !update_timestamps(fileno(fp), entry->mtime, entry->atime)) {
+        fprintf(stderr, "%sCould not update times for %s\n", t_log_prefix, path_str.c_str());
+        ok = false;
+    }
+
+    return fclose(fp) == 0 && ok;
+}
+
+static bool extract_file(const SafeArray *file_data, const recovered_file_entry_t *entry, const raw_source_t *raw,
+                         const std::string &root) {
+    auto buffer = file_data->get(entry->offset, entry->guessed_size);
+    if (!buffer) {
+        return false;
+    }
+
+    return write_output_file(buffer, entry, raw, root);
+}
+
+bool extract_file(const SafeArray *file_data, const recovered_file_entry_t *entry) {
+    return extract_file(file_data, entry, nullptr, ".");
+}
+
+// Writes the file in the directory of its catalog entry through the output tree.
+static bool extract_file(const SafeArray *file_data, const recovered_file_entry_t *entry, OutputTree *tree,
+                         const raw_source_t *raw, const std::string &root) {
+    auto buffer = file_data->get(entry->offset, entry->guessed_size);
+    if (!buffer) {
         return false;
     }
 
-    fclose(fp);
+    auto dir = tree->get_parent_dir(entry->catalog_node);
+    if (dir.get() < 0) {
+        return write_output_file(buffer, entry, raw, root);
+    }
 
-    if (!update_timestamps(path_str.c_str(), &entry->mtime, &entry->atime)) {
-        fprintf(stderr, "Could not update times for %s\n", path_str.c_str());
+    auto path_str = get_output_path(root, entry);
+    auto name = path_str.substr(path_str.rfind('/') + 1);
+    auto fd = openat(dir.get(), name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
         return false;
     }
 
-    return true;
+    bool ok = write_file_data(fd, buffer, entry, raw);
+    if (ok && !update_timestamps(fd, entry->mtime, entry->atime)) {
+        fprintf(stderr, "%sCould not update times for %s\n", t_log_prefix, path_str.c_str());
+        ok = false;
+    }
+
+    return close(fd) == 0 && ok;
 }
 
-bool update_times_for_dirs(const std::vector<parsed_dir_entry_t> &parsed_entries) {
-    std::unordered_map<std::string, parsed_dir_entry_t> by_path;
-    std::vector<std::string> sorted_paths;
-    for (const auto &entry : parsed_entries) {
-        if (!entry.is_dir) {
-            continue;
+// Files in flight on the ring, each with an open, a write and a close request linked together.
+static const unsigned URING_SLOTS = 64;
+static const unsigned URING_ENTRIES = 4 * URING_SLOTS;
+
+enum uring_op_t { URING_OPEN, URING_WRITE, URING_CLOSE };
+
+struct uring_slot_t {
+    size_t entry;
+    // The directory must stay open until the open request completes, and the name alive.
+    std::optional<DirFd> dir;
+    std::string name;
+    unsigned pending;
+    bool failed;
+};
+
+// Writes the files through io_uring. The open places the file in the direct descriptor table at the index of its
+// slot, where the write and the close find it, so that each file costs no syscall of its own but the one setting
+// its times. Returns the files that could not be written this way. Files that the kernel may still be writing when
+// the ring fails go to lost instead, as writing them again would race with it.
+static std::vector<size_t> extract_files_uring(const SafeArray *file_data,
+                                               const std::vector<recovered_file_entry_t> &entries,
+                                               const std::vector<size_t> &selected, IoUring *ring, OutputTree *tree,
+                                               const raw_source_t *raw, std::vector<size_t> &lost) {
+    std::vector<size_t> failed;
+    std::vector<uring_slot_t> slots(URING_SLOTS);
+    std::vector<unsigned> free_slots;
+    for (unsigned i = URING_SLOTS; i > 0; --i) {
+        free_slots.push_back(i - 1);
+    }
+
+    auto finish = [&](unsigned index) {
+        auto &slot = slots[index];
+        const auto &entry = entries[slot.entry];
+        if (slot.failed || !update_timestamps(slot.dir->get(), slot.name.c_str(), entry.mtime, entry.atime)) {
+            failed.push_back(slot.entry);
         }
-        auto path = entry.get_recursive_path();
-        by_path[path] = entry;
-        sorted_paths.push_back(path);
+
+        slot.dir.reset();
+        free_slots.push_back(index);
+    };
+
+    // Files stored verbatim in the archive are left to the regular path, which copies them without reading them.
+    std::vector<file_extent_t> extents;
+    auto is_raw = [&](const recovered_file_entry_t &entry) {
+        return raw && get_raw_extents(*raw->segments, entry.offset, entry.guessed_size, extents);
+    };
+
+    auto complete = [&](const io_uring_cqe &cqe) {
+        auto index = cqe.user_data / 4;
+        auto &slot = slots[index];
+        const auto &entry = entries[slot.entry];
+        switch (cqe.user_data % 4) {
+            case URING_OPEN:
+            case URING_CLOSE:
+                slot.failed |= cqe.res < 0;
+                break;
+            case URING_WRITE:
+                // Short writes are retried by the regular path.
+                slot.failed |= cqe.res < 0 || (size_t) cqe.res != entry.guessed_size;
+                break;
+        }
+
+        if (--slot.pending == 0) {
+            finish(index);
+        }
+    };
+
+    // Slots whose requests are queued but not submitted yet.
+    std::vector<unsigned> queued;
+
+    size_t next = 0;
+    while (next < selected.size() || free_slots.size() < URING_SLOTS) {
+        for (; next < selected.size() && !free_slots.empty(); ++next) {
+            const auto &entry = entries[selected[next]];
+            auto buffer = file_data->get(entry.offset, entry.guessed_size);
+            if (entry.catalog_node == Catalog::NO_NODE || !buffer || is_raw(entry)) {
+                failed.push_back(selected[next]);
+                continue;
+            }
+
+            auto index = free_slots.back();
+            auto &slot = slots[index];
+            slot.dir.emplace(tree->get_parent_dir(entry.catalog_node));
+            if (slot.dir->get() < 0) {
+                slot.dir.reset();
+                failed.push_back(selected[next]);
+                continue;
+            }
+
+            free_slots.pop_back();
+            queued.push_back(index);
+            auto path_str = get_output_path("", &entry);
+            slot.name = path_str.substr(path_str.rfind('/') + 1);
+            slot.entry = selected[next];
+            slot.failed = false;
+            slot.pending = 0;
+
+            // Hard links keep the chain going after a failure, so that the close always runs.
+            auto sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->flags = IOSQE_IO_HARDLINK;
+            sqe->fd = slot.dir->get();
+            sqe->addr = (uint64_t) slot.name.c_str();
+            sqe->len = 0666;
+            // Direct descriptors are never inherited, the kernel rejects O_CLOEXEC for them.
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+            sqe->file_index = index + 1;
+            sqe->user_data = index * 4 + URING_OPEN;
+            ++slot.pending;
+
+            if (entry.guessed_size > 0) {
+                sqe = ring->get_sqe();
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+                sqe->fd = index;
+                sqe->addr = (uint64_t) buffer;
+                sqe->len = entry.guessed_size;
+                sqe->user_data = index * 4 + URING_WRITE;
+                ++slot.pending;
+            }
+
+            sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = index + 1;
+            sqe->user_data = index * 4 + URING_CLOSE;
+            ++slot.pending;
+        }
+
+        // Nothing may be in flight when the remaining files all went to the regular path.
+        if (free_slots.size() == URING_SLOTS) {
+            break;
+        }
+
+        if (!ring->submit(1)) {
+            fprintf(stderr, "%sio_uring_enter: %s\n", t_log_prefix, strerror(errno));
+            failed.insert(failed.end(), selected.begin() + next, selected.end());
+
+            // The kernel took none of the new requests, but those submitted before are still running. Their files
+            // are left to the regular path once they complete.
+            for (auto index : queued) {
+                slots[index].pending = 0;
+                slots[index].failed = true;
+                finish(index);
+            }
+
+            for (auto &slot : slots) {
+                slot.failed = true;
+            }
+
+            while (free_slots.size() < URING_SLOTS) {
+                if (!ring->submit(1) && errno != EAGAIN && errno != EBUSY) {
+                    break;
+                }
+                ring->reap(complete);
+            }
+
+            // Should waiting fail for good, the requests left may still use the directories of their slots.
+            for (auto &slot : slots) {
+                if (slot.pending > 0) {
+                    slot.dir->release();
+                    lost.push_back(slot.entry);
+                }
+            }
+            break;
+        }
+
+        queued.clear();
+        ring->reap(complete);
     }
 
-    // Sort the paths, deepest ones come first.
-    // This is required so that the attributes of the top most folder is updated
-    // after that of the inner most folders. Otherwise the modification
-    // date/time of the restored top most folders will be wrong.
-    std::sort(sorted_paths.begin(), sorted_paths.end(), [](const std::string &a, const std::string &b) {
-        auto ca = std::count(a.begin(), a.end(), '/');
-        auto cb = std::count(b.begin(), b.end(), '/');
-        if (ca != cb) {
-            return ca > cb;
+    return failed;
+}
+
+int extract_files(const SafeArray *file_data, const std::vector<recovered_file_entry_t> &entries,
+                  const Catalog *catalog, ThreadPool *pool, bool use_uring, const raw_source_t *raw,
+                  const std::string &root) {
+    // A later file replaces an earlier one with the same path, only the last one needs writing. The earlier ones
+    // are kept in case it cannot be written, like extracting them in order would have left the previous copy.
+    static const size_t NO_ENTRY = SIZE_MAX;
+    std::unordered_map<std::string, size_t> last_by_path;
+    std::vector<size_t> previous(entries.size(), NO_ENTRY);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        auto it = last_by_path.emplace(get_output_path(root, &entries[i]), i);
+        if (!it.second) {
+            previous[i] = it.first->second;
+            it.first->second = i;
+        }
+    }
+
+    std::vector<size_t> selected;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (last_by_path[get_output_path(root, &entries[i])] == i) {
+            selected.push_back(i);
+        }
+    }
+
+    // Files found in the catalog are created relative to their directory, the others by path.
+    auto tree = catalog ? OutputTree::create(root, *catalog) : nullptr;
+
+    // What io_uring did not write goes through the regular path.
+    std::atomic<int> error_count(0);
+    if (use_uring && tree) {
+        auto ring = IoUring::create(URING_ENTRIES, URING_SLOTS);
+        if (ring) {
+            std::vector<size_t> lost;
+            selected = extract_files_uring(file_data, entries, selected, ring.get(), tree.get(), raw, lost);
+            for (auto index : lost) {
+                fprintf(stderr, "%sCould not extract %s\n", t_log_prefix, entries[index].path.c_str());
+                ++error_count;
+            }
+        } else {
+            fprintf(stderr, "%sio_uring is not available, writing files from threads\n", t_log_prefix);
+        }
+    }
+
+    pool->parallel_for(selected.size(), [&](size_t i) {
+        for (auto index = selected[i]; index != NO_ENTRY; index = previous[index]) {
+            const auto &entry = entries[index];
+            auto ok = tree && entry.catalog_node != Catalog::NO_NODE
+                          ? extract_file(file_data, &entry, tree.get(), raw, root)
+                          : extract_file(file_data, &entry, raw, root);
+            if (ok) {
+                break;
+            }
+
+            fprintf(stderr, "%sCould not extract %s\n", t_log_prefix, entry.path.c_str());
+            ++error_count;
         }
-        return a > b;
     });
 
-    for (const auto &path : sorted_paths) {
-        const auto &entry = by_path[path];
+    return error_count;
+}
 
-        std::stringstream local_path;
-        local_path << "." << path;
-        auto path_str = local_path.str();
+bool extract_indexed_file(const MappedFile *archive, const archive_index_t &index, const recovered_file_entry_t *entry,
+                          ThreadPool *pool) {
+    // A file stored verbatim is copied straight from the archive, without decoding anything.
+    std::vector<file_extent_t> extents;
+    if (get_raw_extents(index.segments, entry->offset, entry->guessed_size, extents)) {
+        raw_source_t raw = {archive, &index.segments};
+        return write_output_file(nullptr, entry, &raw, ".");
+    }
 
-        fs::path fspath(path_str);
-        if (!create_dir_tree(fspath)) {
-            fprintf(stderr, "Could not create %s\n", path_str.c_str());
-            continue;
+    std::vector<uint8_t> buffer;
+    if (!read_data_range(archive, index.segments, entry->offset, entry->guessed_size, buffer, pool)) {
+        return false;
+    }
+
+    auto file_data = SafeArray::create(buffer);
+    auto local_entry = *entry;
+    local_entry.offset = 0;
+    return extract_file(file_data.get(), &local_entry);
+}
+
+void reconcile_with_catalog(const Catalog &catalog, uint32_t node, recovered_file_entry_t &entry, int &error_count) {
+    auto file_size = catalog.file_size(node);
+    if (file_size == entry.guessed_size) {
+        return;
+    }
+
+    fprintf(stderr, "%sMismatched file size for %s: catalog: %#x recovered: %#zx\n", t_log_prefix,
+            entry.path.c_str(), file_size, entry.guessed_size);
+    ++error_count;
+
+    if (entry.guessed_size == 0) {
+        entry.guessed_size = file_size;
+    } else {
+        entry.may_be_corrupted = true;
+    }
+}
+
+// Writes each recovered file as its data streams past. The output file is created under its plain name, and only
+// renamed or truncated once the end of the data tells how it compares with the catalog.
+class StreamingExtractor {
+    const PathTable &m_paths;
+    recovery_stats_t &m_stats;
+
+    uint32_t m_catalog_node;
+    std::string m_path;
+    FILE *m_fp;
+    size_t m_written;
+    bool m_failed;
+
+public:
+    StreamingExtractor(const PathTable &paths, recovery_stats_t &stats)
+        : m_paths(paths), m_stats(stats), m_catalog_node(Catalog::NO_NODE), m_fp(nullptr), m_written(0),
+          m_failed(false) {
+    }
+
+    bool begin(const recovered_file_entry_t &entry) {
+        m_catalog_node = m_paths.find(entry.path);
+        if (m_catalog_node == Catalog::NO_NODE) {
+            return false;
         }
 
-        printf("Updating times for %s\n", path_str.c_str());
-        if (!update_timestamps(path_str.c_str(), &entry.mtime, &entry.atime)) {
-            fprintf(stderr, "Could not update times for %s\n", path_str.c_str());
-            continue;
+        m_path = get_output_path(".", &entry);
+        m_fp = create_output_file(m_path);
+        m_written = 0;
+        m_failed = !m_fp;
+        return m_fp != nullptr;
+    }
+
+    void write(const uint8_t *data, size_t size) {
+        if (!m_failed && fwrite(data, size, 1, m_fp) != 1) {
+            m_failed = true;
         }
+        m_written += size;
     }
 
-    return true;
-}
\ No newline at end of file
+    void end(const recovered_file_entry_t &file) {
+        printf("%s gs=%d size=%zu offset=%#zx\n", file.path.c_str(), file.has_guessed_size, file.guessed_size,
+               file.offset);
+        m_stats.total_size += file.guessed_size;
+        ++m_stats.recovered_count;
+
+        if (m_catalog_node == Catalog::NO_NODE) {
+            fprintf(stderr, "%sCould not find %s in directory catalog\n", t_log_prefix, file.path.c_str());
+            ++m_stats.error_count;
+            return;
+        }
+
+        auto final_entry = file;
+        reconcile_with_catalog(m_paths.catalog(), m_catalog_node, final_entry, m_stats.error_count);
+        if (!m_fp) {
+            fprintf(stderr, "%sCould not extract %s\n", t_log_prefix, file.path.c_str());
+            ++m_stats.error_count;
+            return;
+        }
+
+        m_failed |= fclose(m_fp) != 0;
+        m_fp = nullptr;
+
+        // Unlike extract_file, the bytes past the next record are gone, so a file cannot be longer than
+        // what streamed past before it.
+        auto path_str = get_output_path(".", &final_entry);
+        auto ok = !m_failed && m_written >= final_entry.guessed_size &&
+                  (m_written == final_entry.guessed_size || truncate(m_path.c_str(), final_entry.guessed_size) == 0) &&
+                  (path_str == m_path || rename(m_path.c_str(), path_str.c_str()) == 0);
+        if (!ok) {
+            unlink(m_path.c_str());
+            fprintf(stderr, "%sCould not extract %s\n", t_log_prefix, file.path.c_str());
+            ++m_stats.error_count;
+            return;
+        }
+
+        if (!update_timestamps(path_str.c_str(), final_entry.mtime, final_entry.atime)) {
+            fprintf(stderr, "%sCould not update times for %s\n", t_log_prefix, path_str.c_str());
+        }
+    }
+};
+
+bool recover_files_streaming(const MappedFile *file, size_t start_offset, const PathTable &paths,
+                             recovery_stats_t &stats) {
+    StreamingExtractor extractor(paths, stats);
+    RecordScanner scanner([&](const recovered_file_entry_t &entry) { return extractor.begin(entry); },
+                          [&](const uint8_t *data, size_t size) { extractor.write(data, size); },
+                          [&](const recovered_file_entry_t &entry) { extractor.end(entry); });
+
+    auto ret = read_data_stream(file, start_offset,
+                                [&](const uint8_t *data, size_t size) { scanner.feed(data, size); });
+    scanner.finish();
+
+    stats.occurrence_count = scanner.occurrence_count();
+    printf("%sFound %zu occurrences in data of size=%zu\n", t_log_prefix, stats.occurrence_count, scanner.size());
+    return ret;
+}
+
+// Directories of a level are handed out to the threads a few at a time.
+static const size_t DIR_TIMES_CHUNK_SIZE = 64;
+
+bool update_times_for_dirs(const PathTable &paths, ThreadPool *pool, const std::string &root) {
+    const auto &catalog = paths.catalog();
+
+    // The directories, grouped by depth: those at depth d are dirs[levels[d]] up to dirs[levels[d + 1]].
+    std::vector<size_t> levels(1, 0);
+    for (uint32_t i = 0; i < catalog.size(); ++i) {
+        if (catalog.is_dir(i)) {
+            levels.resize(std::max<size_t>(levels.size(), catalog.depth(i) + 2), 0);
+            ++levels[catalog.depth(i) + 1];
+        }
+    }
+
+    for (size_t depth = 1; depth < levels.size(); ++depth) {
+        levels[depth] += levels[depth - 1];
+    }
+
+    std::vector<uint32_t> dirs(levels.back());
+    auto cursors = levels;
+    for (uint32_t i = 0; i < catalog.size(); ++i) {
+        if (catalog.is_dir(i)) {
+            dirs[cursors[catalog.depth(i)]++] = i;
+        }
+    }
+
+    std::atomic<size_t> error_count(0);
+    auto update = [&](uint32_t node) {
+        // Only the last of several directories with the same path sets its times.
+        auto path = catalog.get_recursive_path(node);
+        if (paths.find(path) != node) {
+            return;
+        }
+
+        auto path_str = root + path;
+        auto mtime = get_time(catalog.mtime(node));
+        auto atime = get_time(catalog.atime(node));
+        if (!create_dir_tree(path_str)) {
+            fprintf(stderr, "%sCould not create %s\n", t_log_prefix, path_str.c_str());
+            ++error_count;
+        } else if (!update_timestamps(path_str.c_str(), mtime, atime)) {
+            fprintf(stderr, "%sCould not update times for %s\n", t_log_prefix, path_str.c_str());
+            ++error_count;
+        }
+    };
+
+    // Deepest directories come first.
+    // This is required so that the attributes of the top most folder is updated
+    // after that of the inner most folders. Otherwise the modification
+    // date/time of the restored top most folders will be wrong.
+    // The directories of a level do not contain each other, so they are updated in parallel.
+    for (auto depth = levels.size() - 1; depth-- > 0;) {
+        auto first = levels[depth];
+        auto count = levels[depth + 1] - first;
+        auto chunk_count = (count + DIR_TIMES_CHUNK_SIZE - 1) / DIR_TIMES_CHUNK_SIZE;
+        auto update_chunk = [&](size_t chunk) {
+            auto end = std::min((chunk + 1) * DIR_TIMES_CHUNK_SIZE, count);
+            for (auto i = chunk * DIR_TIMES_CHUNK_SIZE; i < end; ++i) {
+                update(dirs[first + i]);
+            }
+        };
+
+        if (pool && pool->size() > 1 && chunk_count > 1) {
+            pool->parallel_for(chunk_count, update_chunk);
+        } else {
+            for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+                update_chunk(chunk);
+            }
+        }
+    }
+
+    return error_count == 0;
+}
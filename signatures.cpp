@@ -0,0 +1,180 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#include <string.h>
+#include <vector>
+#include "main.h"
+#include "qic.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+struct signature_set_t {
+    uint32_t values[SIG_COUNT];
+    signature_type_t types[SIG_COUNT];
+    unsigned count;
+};
+
+static uint32_t tag_value(const char *tag) {
+    uint32_t value;
+    memcpy(&value, tag, sizeof(value));
+    return value;
+}
+
+static signature_set_t get_signature_set(unsigned mask) {
+    const uint32_t values[SIG_COUNT] = {DAT_SIG, EDAT_SIG, tag_value(VTBL_TAG), tag_value(MDID_TAG)};
+
+    signature_set_t set = {};
+    for (unsigned type = 0; type < SIG_COUNT; ++type) {
+        if (mask & (1 << type)) {
+            set.values[set.count] = values[type];
+            set.types[set.count] = (signature_type_t) type;
+            ++set.count;
+        }
+    }
+    return set;
+}
+
+static void check_candidate(const uint8_t *data, size_t offset, const signature_set_t &set,
+                            std::vector<signature_hit_t> &hits) {
+    uint32_t value;
+    memcpy(&value, data + offset, sizeof(value));
+    for (unsigned i = 0; i < set.count; ++i) {
+        if (value == set.values[i]) {
+            hits.push_back({offset, set.types[i]});
+            return;
+        }
+    }
+}
+
+// Checks every offset from the given one on.
+static void find_signatures_scalar(const uint8_t *data, size_t size, size_t offset, const signature_set_t &set,
+                                   std::vector<signature_hit_t> &hits) {
+    for (; offset + sizeof(uint32_t) <= size; ++offset) {
+        check_candidate(data, offset, set, hits);
+    }
+}
+
+static void check_candidates(const uint8_t *data, size_t offset, uint32_t bits, const signature_set_t &set,
+                             std::vector<signature_hit_t> &hits) {
+    while (bits) {
+        check_candidate(data, offset + __builtin_ctz(bits), set, hits);
+        bits &= bits - 1;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Candidates match the first and the last byte of a signature, the bytes in between are checked on the few of
+// them there are.
+__attribute__((target("sse2"))) static size_t find_signatures_sse2(const uint8_t *data, size_t size,
+                                                                   const signature_set_t &set,
+                                                                   std::vector<signature_hit_t> &hits) {
+    __m128i first[SIG_COUNT], last[SIG_COUNT];
+    for (unsigned i = 0; i < set.count; ++i) {
+        first[i] = _mm_set1_epi8((char) set.values[i]);
+        last[i] = _mm_set1_epi8((char) (set.values[i] >> 24));
+    }
+
+    size_t offset = 0;
+    for (; offset + 16 + 3 <= size; offset += 16) {
+        auto head = _mm_loadu_si128((const __m128i *) (data + offset));
+        auto tail = _mm_loadu_si128((const __m128i *) (data + offset + 3));
+
+        auto match = _mm_setzero_si128();
+        for (unsigned i = 0; i < set.count; ++i) {
+            match = _mm_or_si128(match, _mm_and_si128(_mm_cmpeq_epi8(head, first[i]), _mm_cmpeq_epi8(tail, last[i])));
+        }
+
+        uint32_t bits = _mm_movemask_epi8(match);
+        if (bits) {
+            check_candidates(data, offset, bits, set, hits);
+        }
+    }
+
+    return offset;
+}
+
+__attribute__((target("avx2"))) static size_t find_signatures_avx2(const uint8_t *data, size_t size,
+                                                                   const signature_set_t &set,
+                                                                   std::vector<signature_hit_t> &hits) {
+    __m256i first[SIG_COUNT], last[SIG_COUNT];
+    for (unsigned i = 0; i < set.count; ++i) {
+        first[i] = _mm256_set1_epi8((char) set.values[i]);
+        last[i] = _mm256_set1_epi8((char) (set.values[i] >> 24));
+    }
+
+    size_t offset = 0;
+    for (; offset + 32 + 3 <= size; offset += 32) {
+        auto head = _mm256_loadu_si256((const __m256i *) (data + offset));
+        auto tail = _mm256_loadu_si256((const __m256i *) (data + offset + 3));
+
+        auto match = _mm256_setzero_si256();
+        for (unsigned i = 0; i < set.count; ++i) {
+            auto both = _mm256_and_si256(_mm256_cmpeq_epi8(head, first[i]), _mm256_cmpeq_epi8(tail, last[i]));
+            match = _mm256_or_si256(match, both);
+        }
+
+        uint32_t bits = _mm256_movemask_epi8(match);
+        if (bits) {
+            check_candidates(data, offset, bits, set, hits);
+        }
+    }
+
+    return offset;
+}
+
+#endif
+
+simd_level_t get_simd_level() {
+#ifdef HAVE_X86_SIMD
+    static const simd_level_t level = __builtin_cpu_supports("avx2")   ? SIMD_AVX2
+                                      : __builtin_cpu_supports("sse2") ? SIMD_SSE2
+                                                                       : SIMD_SCALAR;
+    return level;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+void find_signatures(const uint8_t *data, size_t size, unsigned mask, std::vector<signature_hit_t> &hits,
+                     simd_level_t level) {
+    auto set = get_signature_set(mask);
+    if (set.count == 0) {
+        return;
+    }
+
+    level = std::min(level, get_simd_level());
+
+    size_t offset = 0;
+#ifdef HAVE_X86_SIMD
+    if (level == SIMD_AVX2) {
+        offset = find_signatures_avx2(data, size, set, hits);
+    } else if (level == SIMD_SSE2) {
+        offset = find_signatures_sse2(data, size, set, hits);
+    }
+#endif
+
+    find_signatures_scalar(data, size, offset, set, hits);
+}
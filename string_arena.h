@@ -0,0 +1,96 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+#ifndef _STRING_ARENA_H_
+#define _STRING_ARENA_H_
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Bump allocator for strings that live as long as it does. Blocks never move, so that the views it hands out stay
+// valid, and each string is followed by a NUL.
+class StringArena {
+    static constexpr size_t MIN_BLOCK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> m_blocks;
+    char *m_pos = nullptr;
+    char *m_end = nullptr;
+
+public:
+    StringArena(size_t size = 0) {
+        if (size > 0) {
+            reserve(size);
+        }
+    }
+
+    StringArena(const StringArena &) = delete;
+    StringArena &operator=(const StringArena &) = delete;
+
+    // Makes sure that the next size bytes come from the current block.
+    void reserve(size_t size) {
+        if ((size_t) (m_end - m_pos) >= size) {
+            return;
+        }
+
+        size = std::max(size, MIN_BLOCK_SIZE);
+        m_blocks.emplace_back(new char[size]);
+        m_pos = m_blocks.back().get();
+        m_end = m_pos + size;
+    }
+
+    // Returns room for a string of up to max_size bytes, which becomes part of the arena once committed.
+    char *alloc(size_t max_size) {
+        reserve(max_size + 1);
+        return m_pos;
+    }
+
+    std::string_view commit(size_t size) {
+        auto str = m_pos;
+        str[size] = 0;
+        m_pos += size + 1;
+        return std::string_view(str, size);
+    }
+
+    std::string_view add(std::string_view str) {
+        memcpy(alloc(str.size()), str.data(), str.size());
+        return commit(str.size());
+    }
+
+    // Forgets all the strings, keeping the last block for the next ones.
+    void clear() {
+        if (m_blocks.size() > 1) {
+            m_blocks.erase(m_blocks.begin(), m_blocks.end() - 1);
+        }
+        if (!m_blocks.empty()) {
+            m_pos = m_blocks.back().get();
+        }
+    }
+
+    size_t block_count() const {
+        return m_blocks.size();
+    }
+};
+
+#endif
@@ -21,7 +21,13 @@
 ///
 
 #include <cassert>
+#include <fstream>
 #include "main.h"
+#include "memory_budget.h"
+#include "path_table.h"
+#include "record_scanner.h"
+#include "test_utils.h"
+#include "thread_pool.h"
 
 static void test_decompress() {
     uint8_t compressed[] = {0x20, 0x90, 0x88, 0x38, 0x1C, 0x21, 0xE2, 0x5C, 0x15, 0x80};
@@ -37,6 +43,727 @@ static void test_decompress() {
     assert(decompressed.size() == 16);
 }
 
+static void test_decompress_roundtrip() {
+    auto data = make_sample_data(256 * 1024, 3);
+    auto compressed = test_compress(data.data(), data.size());
+
+    auto array = SafeArray::create(compressed);
+    std::vector<uint8_t> decompressed;
+    assert(decompress(array.get(), decompressed));
+    assert(decompressed == data);
+
+    // Truncated input must fail, but keep what was decoded up to that point.
+    for (auto cut : {1, 2, 7, 8, 9, 100, 1001}) {
+        std::vector<uint8_t> expected, actual;
+        auto expected_ok = reference_decompress(compressed.data(), compressed.size() - cut, expected);
+        auto truncated = SafeArray::create(compressed.data(), compressed.size() - cut);
+        assert(decompress(truncated.get(), actual) == expected_ok);
+        assert(actual == expected);
+    }
+}
+
+static void test_decompress_random() {
+    // Arbitrary bits exercise every token shape, including matches reaching before the start of the output.
+    std::mt19937 rng(4);
+    for (auto i = 0; i < 2000; ++i) {
+        std::vector<uint8_t> input(rng() % 64 + 1);
+        std::generate(input.begin(), input.end(), rng);
+
+        std::vector<uint8_t> expected, actual;
+        auto expected_ok = reference_decompress(input.data(), input.size(), expected);
+        auto array = SafeArray::create(input);
+        assert(decompress(array.get(), actual) == expected_ok);
+        assert(actual == expected);
+    }
+}
+
+static void check_signatures(const std::vector<uint8_t> &buffer, const std::vector<size_t> &signatures) {
+    std::vector<signature_hit_t> expected;
+    find_signatures(buffer.data(), buffer.size(), 1 << SIG_DAT, expected);
+    assert(signatures.size() == expected.size());
+    for (size_t i = 0; i < signatures.size(); ++i) {
+        assert(signatures[i] == expected[i].offset);
+    }
+}
+
+static void test_read_data_segment() {
+    auto data = make_sample_data(512 * 1024, 5);
+    std::vector<uint8_t> noise(20000);
+    std::mt19937 rng(5);
+    std::generate(noise.begin(), noise.end(), rng);
+    data.insert(data.begin() + 100000, noise.begin(), noise.end());
+
+    // Signatures inside segments and straddling their ends.
+    uint32_t dat_sig = DAT_SIG;
+    for (size_t offset = 16 * 1024 - 3; offset + 4 < data.size(); offset += 16 * 1024 + 1) {
+        memcpy(&data[offset], &dat_sig, sizeof(dat_sig));
+        memcpy(&data[offset + 1000], &dat_sig, sizeof(dat_sig));
+    }
+
+    // Output is the same whether the cumulative sizes in the headers can be trusted or not.
+    for (auto with_cumulative_sizes : {true, false}) {
+        auto file = map_temp_file(make_data_region(data, 16 * 1024, with_cumulative_sizes));
+        assert(file);
+
+        std::vector<uint8_t> buffer;
+        std::vector<size_t> signatures;
+        assert(read_data_segment(file.get(), 0, buffer, nullptr, nullptr, &signatures));
+        assert(buffer == data);
+        check_signatures(buffer, signatures);
+    }
+
+    // Decoding in parallel gives the same output as serially, also past a corrupted segment.
+    auto pool = ThreadPool::create(4);
+    for (auto corrupt_offset : {0, 30000, 200000}) {
+        auto region = make_data_region(data, 16 * 1024);
+        for (auto i = 0; i < 64; ++i) {
+            region[corrupt_offset + 10 + i] ^= 0x5a;
+        }
+        auto file = map_temp_file(region);
+
+        std::vector<uint8_t> serial, parallel;
+        std::vector<size_t> serial_signatures, parallel_signatures;
+        auto serial_ok = read_data_segment(file.get(), 0, serial, nullptr, nullptr, &serial_signatures);
+        auto parallel_ok = read_data_segment(file.get(), 0, parallel, pool.get(), nullptr, &parallel_signatures);
+        assert(serial_ok == parallel_ok);
+        assert(serial == parallel);
+        check_signatures(serial, serial_signatures);
+        check_signatures(parallel, parallel_signatures);
+    }
+}
+
+static void test_index() {
+    auto archive = make_test_archive(make_test_tree());
+    auto file = map_temp_file(archive);
+
+    archive_index_t index;
+    std::vector<uint8_t> buffer;
+    index.data_offset = 0x100;
+    index.complete = read_data_segment(file.get(), index.data_offset, buffer, nullptr, &index.segments);
+    auto data = SafeArray::create(buffer);
+    assert(index.complete && recover_files(data.get(), index.files));
+
+    char path[] = "/tmp/qic-test-index-XXXXXX";
+    close(mkstemp(path));
+    assert(save_index(path, file.get(), index));
+
+    archive_index_t loaded;
+    assert(load_index(path, file.get(), loaded));
+    assert(loaded.data_offset == index.data_offset && loaded.complete);
+    assert(loaded.segments.size() == index.segments.size());
+    for (size_t i = 0; i < loaded.segments.size(); ++i) {
+        assert(loaded.segments[i].offset == index.segments[i].offset);
+        assert(loaded.segments[i].cumulative_size == index.segments[i].cumulative_size);
+    }
+    assert(loaded.files.size() == index.files.size());
+    for (size_t i = 0; i < loaded.files.size(); ++i) {
+        assert(loaded.files[i].path == index.files[i].path);
+        assert(loaded.files[i].offset == index.files[i].offset);
+        assert(loaded.files[i].guessed_size == index.files[i].guessed_size);
+        assert(loaded.files[i].mtime == index.files[i].mtime);
+    }
+
+    std::vector<uint8_t> indexed_buffer;
+    assert(decode_segments(file.get(), loaded.segments, indexed_buffer));
+    assert(indexed_buffer == buffer);
+
+    // The index does not apply to another archive, nor once it got truncated.
+    archive[sizeof(qic_vtbl_t) - 1] ^= 1;
+    assert(!load_index(path, map_temp_file(archive).get(), loaded));
+
+    assert(truncate(path, 100) == 0);
+    assert(!load_index(path, file.get(), loaded));
+    unlink(path);
+}
+
+static void test_find_signatures() {
+    const uint32_t values[SIG_COUNT] = {DAT_SIG, EDAT_SIG, 0x4c425456 /* VTBL */, 0x4449444d /* MDID */};
+
+    std::mt19937 rng(9);
+    for (auto round = 0; round < 200; ++round) {
+        // Few distinct byte values, so that partial matches are common.
+        std::vector<uint8_t> data(rng() % 300);
+        for (auto &b : data) {
+            auto v = values[rng() % SIG_COUNT];
+            b = v >> (8 * (rng() % 4));
+        }
+        for (auto i = 0; i < 5 && data.size() >= 4; ++i) {
+            auto offset = i == 0 ? data.size() - 4 : rng() % (data.size() - 3);
+            memcpy(&data[offset], &values[rng() % SIG_COUNT], 4);
+        }
+
+        unsigned mask = round == 0 ? (1 << SIG_COUNT) - 1 : rng() % (1 << SIG_COUNT);
+        std::vector<signature_hit_t> expected;
+        for (size_t offset = 0; offset + 4 <= data.size(); ++offset) {
+            for (unsigned type = 0; type < SIG_COUNT; ++type) {
+                if ((mask & (1 << type)) && !memcmp(&data[offset], &values[type], 4)) {
+                    expected.push_back({offset, signature_type_t(type)});
+                }
+            }
+        }
+
+        for (auto level = SIMD_SCALAR; level <= SIMD_AVX2; level = simd_level_t(level + 1)) {
+            std::vector<signature_hit_t> hits;
+            find_signatures(data.data(), data.size(), mask, hits, level);
+            assert(hits.size() == expected.size());
+            for (size_t i = 0; i < hits.size(); ++i) {
+                assert(hits[i].offset == expected[i].offset && hits[i].type == expected[i].type);
+            }
+        }
+    }
+}
+
+static void test_recover_files_parallel() {
+    auto stream = make_data_stream(make_test_tree());
+    std::vector<uint8_t> data;
+    for (auto i = 0; i < 4; ++i) {
+        data.insert(data.end(), stream.begin(), stream.end());
+    }
+
+    // False positives all over, some of them straddling chunk boundaries. Those near the end could claim names
+    // running past it.
+    uint32_t dat_sig = DAT_SIG;
+    for (size_t offset = 1; offset + 256 * 1024 < data.size(); offset += 4093) {
+        memcpy(&data[offset], &dat_sig, sizeof(dat_sig));
+    }
+
+    auto pool = ThreadPool::create(4);
+    for (auto truncate : {false, true}) {
+        if (truncate) {
+            // End the data in the middle of the header of a record.
+            data.resize(data.size() - stream.size() + 20);
+        }
+
+        auto array = SafeArray::create(data);
+        std::vector<recovered_file_entry_t> serial;
+        auto serial_ok = recover_files(array.get(), serial);
+        assert(serial_ok == !truncate && serial.size() > 10);
+
+        // Also from signatures found beforehand, as while decoding.
+        std::vector<signature_hit_t> hits;
+        find_signatures(data.data(), data.size(), 1 << SIG_DAT, hits);
+        std::vector<size_t> signatures;
+        for (const auto &hit : hits) {
+            signatures.push_back(hit.offset);
+        }
+
+        for (auto known : {false, true}) {
+            std::vector<recovered_file_entry_t> parallel;
+            auto parallel_ok = recover_files(array.get(), parallel, pool.get(), known ? &signatures : nullptr);
+            assert(parallel_ok == serial_ok);
+            assert(serial.size() == parallel.size());
+            for (size_t i = 0; i < serial.size(); ++i) {
+                assert(serial[i].path == parallel[i].path);
+                assert(serial[i].offset == parallel[i].offset);
+                assert(serial[i].has_guessed_size == parallel[i].has_guessed_size);
+                assert(serial[i].guessed_size == parallel[i].guessed_size);
+            }
+        }
+    }
+}
+
+static void test_utf16_to_utf8() {
+    // Surrogate pairs, lone surrogates and a high surrogate at the end decode as through std::codecvt, and ASCII
+    // runs as long as the fast path takes.
+    std::mt19937 rng(12);
+    StringArena arena;
+    for (auto i = 0; i < 20000; ++i) {
+        std::vector<uint16_t> name(rng() % 40);
+        auto ascii_only = rng() % 2;
+        for (auto &c : name) {
+            static const uint16_t ranges[] = {0, 0x80, 0x800, 0xd800, 0xdc00, 0xe000};
+            auto range = ascii_only || rng() % 2 ? 0 : rng() % 6;
+            c = ranges[range] + rng() % (range < 5 ? ranges[range + 1] - ranges[range] : 0x2000);
+        }
+
+        auto size = name.size() * 2 - (name.size() && rng() % 10 == 0);
+        auto expected = reference_utf16_to_utf8(name.data(), size);
+
+        std::vector<char> out(name.size() * 3);
+        auto out_size = utf16_to_utf8(name.data(), size, out.data());
+        assert(out_size >= 0 ? expected == std::string(out.data(), out_size) : expected.empty());
+
+        auto view = utf16_to_utf8(name.data(), size, arena);
+        assert(view == expected && view.data()[view.size()] == 0);
+    }
+}
+
+static void test_read_dir_entries() {
+    auto catalog = make_catalog(make_test_tree());
+    auto buffer = SafeArray::create(catalog);
+
+    Catalog entries;
+    assert(read_dir_entries(buffer.get(), entries));
+
+    uint32_t node = 0;
+    while (node < entries.size() && entries.long_name(node).size() <= 12) {
+        ++node;
+    }
+    assert(node < entries.size() && entries.long_name(node) == "caf\u00e9 \u65e5\u672c.txt");
+    assert(entries.short_name(node).size() && !entries.is_dir(node) && entries.mtime(node) == 900001100);
+}
+
+static void test_get_time() {
+    // Every day and random times, in time zones with and without daylight saving time, and in zones whose standard
+    // time changed over the years.
+    std::vector<unsigned long> dates = {0, 59, 86399, 86400, UINT32_MAX};
+    for (unsigned long day = 0; day <= UINT32_MAX / 86400; ++day) {
+        dates.push_back(day * 86400 + day % 86400);
+    }
+
+    std::mt19937 rng(12);
+    for (auto i = 0; i < 10000; ++i) {
+        dates.push_back(rng());
+    }
+
+    auto tz = getenv("TZ");
+    std::string saved = tz ? tz : "";
+    for (auto zone : {"UTC0", "EST5EDT,M3.2.0,M11.1.0", "CET-1CEST,M3.5.0,M10.5.0/3", "<+0530>-5:30"}) {
+        setenv("TZ", zone, 1);
+        tzset();
+        for (auto date : dates) {
+            assert(get_time(date, timezone) == reference_get_time(date));
+        }
+    }
+
+    for (auto zone : {"Europe/Lisbon", "Europe/London", "Europe/Kiev", "Europe/Moscow", "America/New_York"}) {
+        setenv("TZ", zone, 1);
+        tzset();
+        LocalOffsets offsets;
+        for (auto date : dates) {
+            assert(get_time(date, offsets) == reference_get_time(date));
+        }
+    }
+
+    if (tz) {
+        setenv("TZ", saved.c_str(), 1);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+}
+
+static void check_same_catalog(const Catalog &a, const Catalog &b) {
+    assert(a.size() == b.size() && a.names_size() == b.names_size());
+    for (uint32_t node = 0; node < a.size(); ++node) {
+        assert(a.long_name(node) == b.long_name(node) && a.short_name(node) == b.short_name(node));
+        assert(a.is_dir(node) == b.is_dir(node) && a.is_last_entry(node) == b.is_last_entry(node));
+        assert(a.is_dir_end(node) == b.is_dir_end(node) && a.file_size(node) == b.file_size(node));
+        assert(a.mtime(node) == b.mtime(node) && a.atime(node) == b.atime(node));
+    }
+}
+
+static void test_read_dir_entries_parallel() {
+    // Enough entries for several chunks, some of them with names longer than others.
+    test_entry_t root{u"", true, {}, 900000000, {}};
+    for (auto d = 0; d < 40; ++d) {
+        test_entry_t dir{u"DIR" + std::u16string(d % 5, u'\u00e9'), true, {}, 900000000u + d, {}};
+        for (auto f = 0; f < 1000; ++f) {
+            std::vector<uint8_t> data(f % 3);
+            dir.children.push_back({u"file" + std::u16string(f % 17, u'x'), false, data, 900000000u + f, {}});
+        }
+        root.children.push_back(dir);
+    }
+    auto catalog = make_catalog(root);
+    auto buffer = SafeArray::create(catalog);
+    auto pool = ThreadPool::create(4);
+
+    Catalog expected, entries;
+    assert(read_dir_entries(buffer.get(), expected));
+    assert(read_dir_entries(buffer.get(), entries, pool.get()));
+    assert(entries.size() == 1 + 40 + 40 * 1000);
+    check_same_catalog(expected, entries);
+
+    // The complete entries of a truncated catalog.
+    catalog.resize(catalog.size() * 2 / 3);
+    buffer = SafeArray::create(catalog);
+    Catalog truncated_expected, truncated;
+    assert(!read_dir_entries(buffer.get(), truncated_expected));
+    assert(!read_dir_entries(buffer.get(), truncated, pool.get()));
+    assert(truncated.size() > 20000 && truncated.size() < entries.size());
+    check_same_catalog(truncated_expected, truncated);
+}
+
+static void test_path_table() {
+    // Two directories with the same path, whose children are all found, and the same file twice.
+    auto tree = make_test_tree();
+    auto text = [](const char *s) { return std::vector<uint8_t>(s, s + strlen(s)); };
+    tree.children.push_back({u"COMEXE", true, {}, 0, {{u"other.txt", false, text("other"), 0, {}}}});
+    tree.children.push_back({u"config.sys", false, text("again"), 0, {}});
+
+    auto catalog = make_catalog(tree);
+    auto buffer = SafeArray::create(catalog);
+    Catalog entries;
+    assert(read_dir_entries(buffer.get(), entries));
+    reconstruct_tree(entries);
+
+    // The same entries as a map from full paths.
+    std::unordered_map<std::string, uint32_t> by_path;
+    for (uint32_t node = 0; node < entries.size(); ++node) {
+        by_path[entries.get_recursive_path(node)] = node;
+    }
+
+    PathTable table(entries);
+    for (const auto &it : by_path) {
+        assert(table.find(it.first) == it.second);
+    }
+
+    auto none = Catalog::NO_NODE;
+    assert(table.find("//COMEXE/other.txt") != none && table.find("//COMEXE/STUFF/stuff.dat") != none);
+    assert(table.find("") == none && table.find("COMEXE") == none && table.find("//COMEXE/STUFF/none") == none);
+    assert(table.find("//COMEXE/STUFF/stuff.dat/") == none && table.find("///COMEXE") == none);
+}
+
+static void test_update_times_for_dirs() {
+    char dir[] = "/tmp/qic-test-dirs-XXXXXX";
+    assert(mkdtemp(dir));
+    auto cwd = fs::current_path();
+    fs::current_path(dir);
+
+    // A directory with the same path as another, and a level with more directories than a thread gets at once.
+    auto tree = make_test_tree();
+    tree.children.push_back({u"COMEXE", true, {}, 900005000, {{u"NEW", true, {}, 900006000, {}}}});
+    test_entry_t many{u"MANY", true, {}, 900007000, {}};
+    for (auto i = 0; i < 200; ++i) {
+        auto name = u"d" + std::u16string(1, u'a' + i % 26) + std::u16string(1, u'a' + i / 26);
+        many.children.push_back({name, true, {}, 900008000u + i, {}});
+    }
+    tree.children.push_back(many);
+
+    auto data = make_catalog(tree);
+    auto buffer = SafeArray::create(data);
+    Catalog catalog;
+    assert(read_dir_entries(buffer.get(), catalog));
+    reconstruct_tree(catalog);
+    PathTable paths(catalog);
+
+    auto pool = ThreadPool::create(4);
+    assert(update_times_for_dirs(paths, pool.get()));
+
+    auto mtime = [](const char *path) {
+        struct stat st;
+        assert(stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+        return st.st_mtime;
+    };
+    assert(mtime("./COMEXE") == get_time(900005000) && mtime("./COMEXE/NEW") == get_time(900006000));
+    assert(mtime("./COMEXE/LANGUAGE") == get_time(900000700));
+    assert(mtime("./COMEXE/LANGUAGE/APL") == get_time(900000200));
+    assert(mtime("./MANY") == get_time(900007000) && mtime("./MANY/dzg") == get_time(900008000 + 25 + 26 * 6));
+
+    fs::current_path(cwd);
+    fs::remove_all(dir);
+}
+
+static std::string list_to_string(const Catalog &catalog, list_format_t format) {
+    auto fp = tmpfile();
+    assert(fp && list_catalog(catalog, format, fileno(fp)));
+    std::string ret(lseek(fileno(fp), 0, SEEK_END), 0);
+    assert(pread(fileno(fp), ret.data(), ret.size(), 0) == (ssize_t) ret.size());
+    fclose(fp);
+    return ret;
+}
+
+static void test_list_catalog() {
+    // Names that need quoting, and a leap day of 2000, which the conversion of get_time does not have.
+    auto tree = make_test_tree();
+    tree.children.push_back({u"a,\"b\"", true, {}, 951825600, {{u"x\\y", false, {1, 2, 3}, 900000060, {}}}});
+
+    auto data = make_catalog(tree);
+    auto buffer = SafeArray::create(data);
+    Catalog catalog;
+    assert(read_dir_entries(buffer.get(), catalog));
+    reconstruct_tree(catalog);
+
+    auto text = list_to_string(catalog, LIST_TEXT);
+    assert(text.find("d            0 1998-07-09 16:13:20 /COMEXE\n") == 0);
+    assert(text.find("\nd            0 2000-02-29 12:00:00 /a,\"b\"\n") != std::string::npos);
+    assert(text.find("\n-            3 1998-07-09 16:01:00 /a,\"b\"/x\\y\n") != std::string::npos);
+    assert(std::count(text.begin(), text.end(), '\n') == (long) catalog.size() - 1);
+
+    std::string mtime = "1998-07-09 16:01:00";
+    auto json = list_to_string(catalog, LIST_JSON);
+    assert(json.find("[\n{\"path\":\"/COMEXE\",\"type\":\"dir\",\"size\":0,\"mtime\":") == 0);
+    assert(json.find("\n{\"path\":\"/a,\\\"b\\\"/x\\\\y\",\"type\":\"file\",\"size\":3,\"mtime\":\"" + mtime + "\"}\n]\n") !=
+           std::string::npos);
+
+    auto csv = list_to_string(catalog, LIST_CSV);
+    assert(csv.find("path,type,size,mtime\n/COMEXE,dir,0,") == 0);
+    assert(csv.find("\n\"/a,\"\"b\"\"/x\\y\",file,3," + mtime + "\n") != std::string::npos);
+
+    // The tree is listed depth first, children after their parent.
+    assert(csv.find("/COMEXE/LANGUAGE/C/hello.c") < csv.find("/COMEXE/LANGUAGE/BASIC,"));
+}
+
+static void test_memory_budget() {
+    MemoryBudget budget(100);
+    budget.acquire(60);
+
+    // The second request does not fit until the first one is released.
+    std::atomic<bool> acquired(false);
+    std::thread waiter([&] {
+        budget.acquire(60);
+        acquired = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!acquired);
+
+    budget.release(60);
+    waiter.join();
+    assert(acquired);
+    budget.release(60);
+
+    // A request larger than the budget proceeds once nothing else is held.
+    budget.acquire(500);
+    budget.release(500);
+}
+
+static void test_run_batch() {
+    char dir[] = "/tmp/qic-test-batch-XXXXXX";
+    assert(mkdtemp(dir));
+    auto in = std::string(dir) + "/in", other = std::string(dir) + "/other", out = std::string(dir) + "/out";
+    assert(fs::create_directory(in) && fs::create_directory(other));
+
+    auto write_file = [](const std::string &path, const std::vector<uint8_t> &data) {
+        std::ofstream(path, std::ios::binary).write((const char *) data.data(), data.size());
+    };
+
+    // Two archives of the same name in different directories, one that cannot be read, and a file that is not
+    // an archive.
+    auto tree = make_test_tree();
+    auto other_tree = make_test_tree();
+    other_tree.children.push_back({u"other.txt", false, {'o', 'k'}, 900002000, {}});
+    write_file(in + "/disk.qic", make_test_archive(tree));
+    write_file(in + "/bad.QIC", {1, 2, 3});
+    write_file(in + "/notes.txt", {});
+    write_file(other + "/disk.qic", make_test_archive(other_tree, 4096));
+
+    std::vector<std::string> archives;
+    assert(find_archives({in, other + "/disk.qic"}, archives));
+    assert((archives == std::vector<std::string>{in + "/bad.QIC", in + "/disk.qic", other + "/disk.qic"}));
+    assert((get_output_roots(out, archives) == std::vector<std::string>{out + "/bad", out + "/disk", out + "/disk-2"}));
+
+    auto pool = ThreadPool::create(4);
+    auto writers = ThreadPool::create(4);
+    assert(run_batch({in, other + "/disk.qic"}, out, pool.get(), writers.get(), false, false, 1 << 20) == -11);
+
+    auto read_file = [](const std::string &path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    };
+    auto mtime = [](const std::string &path) {
+        struct stat st;
+        assert(stat(path.c_str(), &st) == 0);
+        return st.st_mtime;
+    };
+
+    // Each archive is extracted with its times in its own tree, whatever happens to the others.
+    for (auto root : {out + "/disk", out + "/disk-2"}) {
+        assert(read_file(root + "/COMEXE/LANGUAGE/C/hello.c") == "int main() {}\n");
+        assert(mtime(root + "/COMEXE/LANGUAGE/C/hello.c") == get_time(900000300));
+        assert(mtime(root + "/COMEXE/LANGUAGE/C") == get_time(900000400));
+        assert(mtime(root + "/COMEXE/LANGUAGE/APL") == get_time(900000200));
+        assert(mtime(root + "/TEXT") == get_time(900001200));
+    }
+    assert(!fs::exists(out + "/disk/other.txt") && read_file(out + "/disk-2/other.txt") == "ok");
+    assert(mtime(out + "/disk-2/other.txt") == get_time(900002000));
+    assert(!fs::exists(out + "/bad/COMEXE") && !fs::exists("./COMEXE"));
+
+    fs::remove_all(dir);
+}
+
+static void check_extract_files(bool use_uring) {
+    char dir[] = "/tmp/qic-test-extract-XXXXXX";
+    assert(mkdtemp(dir));
+    auto cwd = fs::current_path();
+    fs::current_path(dir);
+
+    // Runs of noise end up in raw segments, alone or next to each other, files spanning some of them are copied
+    // from the archive.
+    auto data = make_sample_data(64 * 1024, 10);
+    std::mt19937 rng(10);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (i / 1024) % 3 ? rng() : data[i];
+    }
+    auto archive = map_temp_file(make_data_region(data, 1024));
+    std::vector<uint8_t> buffer;
+    std::vector<segment_t> segments;
+    assert(read_data_segment(archive.get(), 0, buffer, nullptr, &segments) && buffer == data);
+    auto file_data = SafeArray::create(buffer);
+    raw_source_t raw = {archive.get(), &segments};
+
+    // Catalog nodes for /d<i>/e<j>, under a nameless root.
+    Catalog catalog;
+    auto add_node = [&](const std::string &name, uint32_t parent) {
+        parsed_dir_entry_t entry;
+        entry.long_name = name;
+        auto node = catalog.add(entry);
+        catalog.set_parent(node, parent);
+        return node;
+    };
+    auto root = add_node("", Catalog::NO_NODE);
+    std::vector<uint32_t> dirs;
+    for (auto d = 0; d < 7; ++d) {
+        auto dir = add_node("d" + std::to_string(d), root);
+        for (auto e = 0; e < 3; ++e) {
+            dirs.push_back(add_node("e" + std::to_string(e), dir));
+        }
+    }
+
+    // Many files sharing directories, the same path twice, and files whose data lies past the end, one of them
+    // the last copy of a path, which leaves the previous copy. Half of them are in the catalog.
+    std::vector<recovered_file_entry_t> entries;
+    for (auto i = 0; i < 200; ++i) {
+        recovered_file_entry_t entry;
+        entry.path = "//d" + std::to_string(i % 7) + "/e" + std::to_string(i % 3) + "/f" + std::to_string(i);
+        if (i % 2) {
+            entry.catalog_node = add_node("f" + std::to_string(i), dirs[(i % 7) * 3 + i % 3]);
+        }
+        entry.offset = i * 100;
+        entry.guessed_size = i;
+        entry.mtime = entry.atime = 631152000;
+        entries.push_back(entry);
+    }
+    entries[150].path = entries[10].path;
+    entries[150].catalog_node = Catalog::NO_NODE;
+    entries[160].path = entries[20].path;
+    entries[160].guessed_size = data.size();
+    entries[199].guessed_size = data.size();
+
+    auto pool = ThreadPool::create(8);
+    assert(extract_files(file_data.get(), entries, &catalog, pool.get(), use_uring, &raw) == 2);
+
+    for (auto i = 0; i < 199; ++i) {
+        if (i == 10 || i == 160) {
+            continue;
+        }
+
+        auto path = "." + entries[i].path;
+        std::ifstream in(path, std::ios::binary);
+        std::vector<uint8_t> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        assert(std::equal(contents.begin(), contents.end(), data.begin() + entries[i].offset));
+        assert(contents.size() == entries[i].guessed_size);
+
+        struct stat st;
+        assert(stat(path.c_str(), &st) == 0 && st.st_mtime == entries[i].mtime);
+    }
+
+    fs::current_path(cwd);
+    fs::remove_all(dir);
+}
+
+static void test_recover_files_streaming() {
+    char dir[] = "/tmp/qic-test-streaming-XXXXXX";
+    assert(mkdtemp(dir));
+    auto cwd = fs::current_path();
+    fs::current_path(dir);
+
+    auto tree = make_test_tree();
+    auto data = make_catalog(tree);
+    auto buffer = SafeArray::create(data);
+    Catalog catalog;
+    assert(read_dir_entries(buffer.get(), catalog));
+    reconstruct_tree(catalog);
+    PathTable paths(catalog);
+
+    auto archive = make_test_archive(tree, 4096);
+    recovery_stats_t stats;
+    assert(recover_files_streaming(map_temp_file(archive).get(), 0x100, paths, stats));
+    assert(fs::file_size("./TEXT/readme.txt") == 50000);
+    fs::remove_all("./TEXT");
+
+    // The data stops in the middle of readme.txt, which is not extracted and counts as an error on top of its
+    // size that does not match the catalog.
+    archive.resize(0x100 + 64 * 1024);
+    recovery_stats_t truncated_stats;
+    assert(!recover_files_streaming(map_temp_file(archive).get(), 0x100, paths, truncated_stats));
+    assert(truncated_stats.error_count == stats.error_count + 1);
+    assert(!fs::exists("./TEXT/readme.txt") && fs::file_size("./config.sys") == 18);
+
+    fs::current_path(cwd);
+    fs::remove_all(dir);
+}
+
+static void test_get_raw_extents() {
+    auto data = make_sample_data(8 * 1024, 11, true);
+    std::mt19937 rng(11);
+    std::generate(data.begin() + 1024, data.begin() + 3072, rng);
+    auto archive = map_temp_file(make_data_region(data, 1024));
+    std::vector<uint8_t> buffer;
+    std::vector<segment_t> segments;
+    assert(read_data_segment(archive.get(), 0, buffer, nullptr, &segments));
+    assert(segments[0].compressed && !segments[1].compressed && !segments[2].compressed);
+
+    // Across the headers of two raw segments.
+    std::vector<file_extent_t> extents;
+    assert(get_raw_extents(segments, 2000, 100, extents) && extents.size() == 2);
+    assert(extents[0].offset == segments[1].offset + 976 && extents[0].size == 48);
+    assert(extents[1].offset == segments[2].offset && extents[1].size == 52);
+
+    assert(get_raw_extents(segments, 1024, 1024, extents) && extents.size() == 1);
+    assert(!get_raw_extents(segments, 1000, 100, extents));
+    assert(!get_raw_extents(segments, 3000, 100, extents));
+    assert(!get_raw_extents(segments, 2000, 8 * 1024, extents));
+}
+
+static void test_extract_files() {
+    check_extract_files(false);
+    check_extract_files(true);
+}
+
+static void check_record_scanner(const std::vector<uint8_t> &data, uint32_t seed) {
+    auto array = SafeArray::create(const_cast<uint8_t *>(data.data()), data.size());
+    std::vector<recovered_file_entry_t> expected;
+    auto expected_ok = recover_files(array.get(), expected);
+
+    std::vector<recovered_file_entry_t> actual;
+    std::vector<uint8_t> file_data;
+    RecordScanner scanner([&](const recovered_file_entry_t &entry) { return true; },
+                          [&](const uint8_t *data, size_t size) {
+                              file_data.insert(file_data.end(), data, data + size);
+                          },
+                          [&](const recovered_file_entry_t &entry) {
+                              auto start = data.begin() + std::min(entry.offset, data.size());
+                              auto end = entry.has_guessed_size ? start + entry.guessed_size : data.end();
+                              assert(std::equal(file_data.begin(), file_data.end(), start, end));
+                              file_data.clear();
+                              actual.push_back(entry);
+                          });
+
+    // Feed the stream in chunks of random sizes, so that records and signatures straddle them.
+    std::mt19937 rng(seed);
+    for (size_t offset = 0; offset < data.size();) {
+        auto size = std::min<size_t>(rng() % 5000 + 1, data.size() - offset);
+        scanner.feed(&data[offset], size);
+        offset += size;
+    }
+
+    assert(scanner.finish() == expected_ok);
+    assert(actual.size() == expected.size());
+    for (size_t i = 0; i < actual.size(); ++i) {
+        assert(actual[i].path == expected[i].path);
+        assert(actual[i].offset == expected[i].offset);
+        assert(actual[i].has_guessed_size == expected[i].has_guessed_size);
+        assert(actual[i].guessed_size == expected[i].guessed_size);
+    }
+}
+
+static void test_record_scanner() {
+    auto data = make_data_stream(make_test_tree());
+
+    // A stray signature in file data, as found in backups of QIC archives.
+    uint32_t dat_sig = DAT_SIG;
+    memcpy(&data[1000], &dat_sig, sizeof(dat_sig));
+
+    for (uint32_t seed = 0; seed < 10; ++seed) {
+        check_record_scanner(data, seed);
+    }
+
+    // Data ending in the middle of a record.
+    auto hello = std::search(data.begin(), data.end(), std::begin(u"hello.c"), std::end(u"hello.c") - 1);
+    data.resize((uint8_t *) &*hello - data.data() + 4);
+    check_record_scanner(data, 0);
+}
+
 /*           dir last_dir
 COMEXE       1 0
 config.sys   0 0
@@ -54,47 +781,73 @@ readme.txt   0 1
 
 static void test(void) {
     // clang-format off
-    std::vector<parsed_dir_entry_t> entries = {
-        {.long_name="", .short_name="", .is_dir=true, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr},
-        {.long_name="COMEXE", .short_name="COMEXE", .is_dir=true, .is_empty_dir=false, .is_last_entry=false, .parent=nullptr},
-        {.long_name="config.sys", .short_name="config.sys", .is_dir=false, .is_empty_dir=false, .is_last_entry=false, .parent=nullptr},
-        {.long_name="TEXT", .short_name="TEXT", .is_dir=true, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr},
-        {.long_name="STUFF", .short_name="STUFF", .is_dir=true, .is_empty_dir=false, .is_last_entry=false, .parent=nullptr},
-        {.long_name="LANGUAGE", .short_name="LANGUAGE", .is_dir=true, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr},
-        {.long_name="stuff.dat", .short_name="stuff.dat", .is_dir=false, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr},
-        {.long_name="APL", .short_name="APL", .is_dir=true, .is_empty_dir=true, .is_last_entry=false, .parent=nullptr},
-        {.long_name="C", .short_name="C", .is_dir=true, .is_empty_dir=false, .is_last_entry=false, .parent=nullptr},
-        {.long_name="BASIC", .short_name="BASIC", .is_dir=true, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr},
-        {.long_name="hello.c", .short_name="hello.c", .is_dir=false, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr},
-        {.long_name="mortgage.bas", .short_name="mortgage.bas", .is_dir=false, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr},
-        {.long_name="readme.txt", .short_name="readme.txt", .is_dir=false, .is_empty_dir=false, .is_last_entry=true, .parent=nullptr}
+    std::vector<parsed_dir_entry_t> parsed = {
+        {.long_name="", .short_name="", .is_dir=true, .is_empty_dir=false, .is_last_entry=true},
+        {.long_name="COMEXE", .short_name="COMEXE", .is_dir=true, .is_empty_dir=false, .is_last_entry=false},
+        {.long_name="config.sys", .short_name="config.sys", .is_dir=false, .is_empty_dir=false, .is_last_entry=false},
+        {.long_name="TEXT", .short_name="TEXT", .is_dir=true, .is_empty_dir=false, .is_last_entry=true},
+        {.long_name="STUFF", .short_name="STUFF", .is_dir=true, .is_empty_dir=false, .is_last_entry=false},
+        {.long_name="LANGUAGE", .short_name="LANGUAGE", .is_dir=true, .is_empty_dir=false, .is_last_entry=true},
+        {.long_name="stuff.dat", .short_name="stuff.dat", .is_dir=false, .is_empty_dir=false, .is_last_entry=true},
+        {.long_name="APL", .short_name="APL", .is_dir=true, .is_empty_dir=true, .is_last_entry=false},
+        {.long_name="C", .short_name="C", .is_dir=true, .is_empty_dir=false, .is_last_entry=false},
+        {.long_name="BASIC", .short_name="BASIC", .is_dir=true, .is_empty_dir=false, .is_last_entry=true},
+        {.long_name="hello.c", .short_name="hello.c", .is_dir=false, .is_empty_dir=false, .is_last_entry=true},
+        {.long_name="mortgage.bas", .short_name="mortgage.bas", .is_dir=false, .is_empty_dir=false, .is_last_entry=true},
+        {.long_name="readme.txt", .short_name="readme.txt", .is_dir=false, .is_empty_dir=false, .is_last_entry=true}
     };
     // clang-format on
 
+    Catalog entries;
+    for (const auto &entry : parsed) {
+        entries.add(entry);
+    }
     reconstruct_tree(entries);
 
-    for (const auto &entry : entries) {
-        auto path = entry.get_recursive_path();
-        printf("D=%d ED=%d LE=%d LN=%-20s %s\n", entry.is_dir, entry.is_empty_dir, entry.is_last_entry,
-               entry.long_name.c_str(), path.c_str());
+    for (uint32_t node = 0; node < entries.size(); ++node) {
+        auto path = entries.get_recursive_path(node);
+        printf("D=%d ED=%d LE=%d LN=%-20s %s\n", entries.is_dir(node), entries.is_empty_dir(node),
+               entries.is_last_entry(node), entries.long_name(node).data(), path.c_str());
+    }
+
+    std::vector<uint32_t> expected = {Catalog::NO_NODE, 0, 0, 0, 1, 1, 4, 5, 5, 5, 8, 9, 3};
+    for (uint32_t node = 0; node < entries.size(); ++node) {
+        assert(entries.parent(node) == expected[node]);
     }
 
-    assert(entries[0].parent == nullptr);
-    assert(entries[1].parent == &entries[0]);
-    assert(entries[2].parent == &entries[0]);
-    assert(entries[3].parent == &entries[0]);
-    assert(entries[4].parent == &entries[1]);
-    assert(entries[5].parent == &entries[1]);
-    assert(entries[6].parent == &entries[4]);
-    assert(entries[7].parent == &entries[5]);
-    assert(entries[8].parent == &entries[5]);
-    assert(entries[9].parent == &entries[5]);
-    assert(entries[10].parent == &entries[8]);
-    assert(entries[11].parent == &entries[9]);
-    assert(entries[12].parent == &entries[3]);
+    assert(entries.depth(0) == 0 && entries.depth(3) == 1 && entries.depth(10) == 4 && entries.depth(12) == 2);
+    assert(entries.child_count(0) == 3 && entries.child(0, 0) == 1 && entries.child(0, 2) == 3);
+    assert(entries.child_count(5) == 3 && entries.child(5, 1) == 8 && entries.child_count(7) == 0);
+    assert(entries.child_count(12) == 0 && entries.child(3, 0) == 12);
+
+    // A group left without a directory ends up at the top.
+    parsed_dir_entry_t extra = parsed[2];
+    extra.is_last_entry = true;
+    auto node = entries.add(extra);
+    reconstruct_tree(entries);
+    assert(entries.parent(node) == Catalog::NO_NODE && entries.depth(node) == 0 && entries.parent(12) == 3);
 }
 
 int main(int argc, char **argv) {
     test();
     test_decompress();
+    test_decompress_roundtrip();
+    test_decompress_random();
+    test_read_data_segment();
+    test_record_scanner();
+    test_index();
+    test_find_signatures();
+    test_recover_files_parallel();
+    test_extract_files();
+    test_recover_files_streaming();
+    test_update_times_for_dirs();
+    test_get_raw_extents();
+    test_utf16_to_utf8();
+    test_read_dir_entries();
+    test_read_dir_entries_parallel();
+    test_get_time();
+    test_list_catalog();
+    test_memory_budget();
+    test_run_batch();
+    test_path_table();
 }
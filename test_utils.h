@@ -0,0 +1,542 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+
+#ifndef _TEST_UTILS_H_
+#define _TEST_UTILS_H_
+
+#include <algorithm>
+#include <codecvt>
+#include <cstring>
+#include <functional>
+#include <inttypes.h>
+#include <locale>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "qic.h"
+
+// Helpers shared by the test and bench programs.
+
+// Writes bits most significant first, the way the decompressor reads them.
+class BitWriter {
+    std::vector<uint8_t> &m_out;
+    size_t m_bit_pos;
+
+public:
+    BitWriter(std::vector<uint8_t> &out) : m_out(out), m_bit_pos(0) {
+    }
+
+    void put(uint32_t value, unsigned count) {
+        while (count-- > 0) {
+            if (m_bit_pos % 8 == 0) {
+                m_out.push_back(0);
+            }
+            m_out.back() |= ((value >> count) & 1) << (7 - m_bit_pos % 8);
+            ++m_bit_pos;
+        }
+    }
+};
+
+// Greedy LZ encoder producing the MSBACKUP compressed segment format.
+static std::vector<uint8_t> test_compress(const uint8_t *data, size_t size) {
+    std::vector<uint8_t> out;
+    BitWriter writer(out);
+
+    // Hash chains over 2-byte prefixes, walked a bounded number of steps.
+    std::vector<int64_t> head(1 << 16, -1), prev(size, -1);
+    auto insert = [&](size_t p) {
+        if (p + 1 < size) {
+            auto h = data[p] | (data[p + 1] << 8);
+            prev[p] = head[h];
+            head[h] = p;
+        }
+    };
+
+    size_t pos = 0;
+    while (pos < size) {
+        size_t best_len = 0, best_offset = 0;
+        if (pos + 1 < size) {
+            auto candidate = head[data[pos] | (data[pos + 1] << 8)];
+            for (auto steps = 0; candidate >= 0 && pos - candidate <= 2047 && steps < 32; ++steps) {
+                size_t len = 0;
+                while (pos + len < size && len < 1024 && data[pos + len] == data[candidate + len]) {
+                    ++len;
+                }
+                if (len > best_len) {
+                    best_len = len;
+                    best_offset = pos - candidate;
+                }
+                candidate = prev[candidate];
+            }
+        }
+
+        if (best_len < 2) {
+            insert(pos);
+            writer.put(data[pos++], 9);
+            continue;
+        }
+
+        writer.put(1, 1);
+        if (best_offset < 128) {
+            writer.put(1, 1);
+            writer.put(best_offset, 7);
+        } else {
+            writer.put(0, 1);
+            writer.put(best_offset, 11);
+        }
+
+        if (best_len <= 4) {
+            writer.put(best_len - 2, 2);
+        } else if (best_len <= 7) {
+            writer.put(3, 2);
+            writer.put(best_len - 5, 2);
+        } else {
+            writer.put(0xf, 4);
+            size_t rem = best_len - 6;
+            while (rem > 16) {
+                writer.put(0xf, 4);
+                rem -= 15;
+            }
+            writer.put(rem - 2, 4);
+        }
+
+        for (size_t i = 0; i < best_len; ++i) {
+            insert(pos++);
+        }
+    }
+
+    // End marker: a 7-bit zero offset.
+    writer.put(3, 2);
+    writer.put(0, 7);
+    return out;
+}
+
+// Conversion get_time replaced, in the local time zone.
+static time_t reference_get_time(unsigned long date) {
+    struct tm ret = {0};
+    uint8_t mondays[] = {31, 28, 31, 30, 31, 30, 31, 31, 31, 30, 31, 31};
+    uint16_t yr = 1970, mon = 0, day, hour, min, sec;
+    char lpyr;
+    sec = date % 60;
+    date /= 60;
+    min = date % 60;
+    date /= 60;
+    hour = date % 24;
+    date /= 24;
+    do {
+        if ((yr % 100) == 0 || (yr % 4) != 0) {
+            day = 365;
+            lpyr = 0;
+        } else {
+            day = 366;
+            lpyr = 1;
+        }
+        if (date > day) {
+            yr++;
+            date -= day;
+        }
+    } while (date > day);
+    day = date;
+
+    mondays[1] += lpyr;
+    while (mon < 12) {
+        if (mondays[mon] >= day) {
+            break;
+        } else {
+            day -= mondays[mon++];
+        }
+    }
+
+    ret.tm_mday = day;
+    ret.tm_mon = mon + 1;
+    ret.tm_year = yr - 1900;
+    ret.tm_hour = hour;
+    ret.tm_min = min;
+    ret.tm_sec = sec;
+    return mktime(&ret);
+}
+
+// Conversion the hand-written transcoder replaced, empty for invalid input.
+static std::string reference_utf16_to_utf8(const void *buffer, size_t size_in_bytes) {
+    if (size_in_bytes % 2 != 0) {
+        return "";
+    }
+
+    try {
+        std::u16string utf16_str(static_cast<const char16_t *>(buffer), size_in_bytes / 2);
+        std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> convert;
+        return convert.to_bytes(utf16_str);
+    } catch (...) {
+        return "";
+    }
+}
+
+// Single-needle search the signature scanner replaced.
+static std::vector<size_t> reference_search(const uint8_t *haystack, size_t haystack_size, const uint8_t *needle,
+                                            size_t needle_size) {
+    std::vector<size_t> occurrences;
+    if (needle_size == 0 || haystack_size < needle_size) {
+        return occurrences;
+    }
+
+    auto searcher = std::boyer_moore_searcher(needle, needle + needle_size);
+    const uint8_t *end = haystack + haystack_size;
+
+    auto it = haystack;
+    while (it != end) {
+        it = std::search(it, end, searcher);
+        if (it != end) {
+            occurrences.push_back(it - haystack);
+            ++it;
+        }
+    }
+
+    return occurrences;
+}
+
+// Bit-serial decoder the optimized one is checked and benchmarked against.
+static bool reference_decompress(const uint8_t *in, size_t size, std::vector<uint8_t> &out) {
+    size_t bit_pos = 0;
+    auto get_bits = [&](unsigned count, uint32_t *value) {
+        *value = 0;
+        while (count-- > 0) {
+            if (bit_pos >= size * 8) {
+                return false;
+            }
+            *value = (*value << 1) | ((in[bit_pos / 8] >> (7 - bit_pos % 8)) & 1);
+            ++bit_pos;
+        }
+        return true;
+    };
+
+    std::vector<uint8_t> history(2048);
+    size_t hpos = 0;
+    auto put = [&](uint8_t byte) {
+        if (hpos == history.size()) {
+            out.insert(out.end(), history.begin(), history.end());
+            hpos = 0;
+        }
+        history[hpos++] = byte;
+    };
+    auto flush = [&]() { out.insert(out.end(), history.begin(), history.begin() + hpos); };
+
+    while (true) {
+        uint32_t flag, value;
+        if (!get_bits(1, &flag)) {
+            break;
+        }
+
+        if (!flag) {
+            if (!get_bits(8, &value)) {
+                break;
+            }
+            put(value);
+            continue;
+        }
+
+        uint32_t is_7bit, offset;
+        if (!get_bits(1, &is_7bit) || !get_bits(is_7bit ? 7 : 11, &offset)) {
+            break;
+        }
+
+        if (offset == 0) {
+            flush();
+            return true;
+        }
+
+        uint32_t length = 0, nibble;
+        bool ok = false;
+        for (auto i = 0; i < 2 && !ok; i++) {
+            if (!get_bits(2, &nibble)) {
+                flush();
+                return false;
+            }
+            length += nibble < 3 ? nibble + 2 : 3;
+            ok = nibble < 3;
+        }
+        while (!ok) {
+            if (!get_bits(4, &nibble)) {
+                flush();
+                return false;
+            }
+            length += nibble < 15 ? nibble + 2 : 15;
+            ok = nibble < 15;
+        }
+
+        while (length-- > 0) {
+            size_t index = hpos >= offset ? hpos - offset : hpos + 2048 - offset;
+            put(history[index % 2048]);
+        }
+    }
+
+    flush();
+    return false;
+}
+
+static const char *SAMPLE_WORDS[] = {"the ", "file ", "backup ", "WINDOWS", "\\SYSTEM\\", "config", ".sys ", "\r\n"};
+
+static void append_words(std::vector<uint8_t> &data, std::mt19937 &rng, size_t count) {
+    while (count-- > 0) {
+        auto w = SAMPLE_WORDS[rng() % 8];
+        data.insert(data.end(), w, w + strlen(w));
+    }
+}
+
+// Pseudo-random data resembling a disk image: text-like runs, binary noise and zero-filled regions.
+// With text_only, only the text-like runs are generated, which compress to mostly short matches.
+static std::vector<uint8_t> make_sample_data(size_t size, uint32_t seed, bool text_only = false) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> data;
+    while (data.size() < size) {
+        switch (text_only ? 2 : rng() % 4) {
+            case 0:
+                data.insert(data.end(), rng() % 4096, 0);
+                break;
+            case 1:
+                for (auto i = rng() % 256; i > 0; --i) {
+                    data.push_back(rng());
+                }
+                break;
+            default:
+                append_words(data, rng, rng() % 512);
+                break;
+        }
+    }
+    data.resize(size);
+    return data;
+}
+
+// Lays out data as a QIC data region: each chunk becomes a segment preceded by its cseg_head_t and
+// cframe_head_t, stored raw when it does not compress, and a zero-sized frame ends the region.
+static std::vector<uint8_t> make_data_region(const std::vector<uint8_t> &data, size_t chunk_size,
+                                             bool with_cumulative_sizes = true) {
+    std::vector<uint8_t> region;
+    auto append = [&](const void *p, size_t size) {
+        region.insert(region.end(), (const uint8_t *) p, (const uint8_t *) p + size);
+    };
+
+    for (size_t i = 0; i < data.size(); i += chunk_size) {
+        auto size = std::min(chunk_size, data.size() - i);
+        auto compressed = test_compress(&data[i], size);
+        bool raw = compressed.size() >= size;
+
+        cseg_head_t seg_head = {with_cumulative_sizes ? i + size : 0};
+        cframe_head_t frame_head = {uint16_t(raw ? size | RAW_SEG : compressed.size())};
+        append(&seg_head, sizeof(seg_head));
+        append(&frame_head, sizeof(frame_head));
+        if (raw) {
+            append(&data[i], size);
+        } else {
+            append(compressed.data(), compressed.size());
+        }
+    }
+
+    cseg_head_t seg_head = {0};
+    cframe_head_t frame_head = {0};
+    append(&seg_head, sizeof(seg_head));
+    append(&frame_head, sizeof(frame_head));
+    return region;
+}
+
+// Entry of a directory tree to lay out as a QIC archive.
+struct test_entry_t {
+    std::u16string name;
+    bool is_dir;
+    std::vector<uint8_t> data;
+    uint32_t mtime;
+    std::vector<test_entry_t> children;
+};
+
+static void append_bytes(std::vector<uint8_t> &out, const void *p, size_t size) {
+    out.insert(out.end(), (const uint8_t *) p, (const uint8_t *) p + size);
+}
+
+// Appends the ms_dir_fixed_t, long name, ms_dir_fixed2_t and short name of an entry.
+static void append_dir_entry(std::vector<uint8_t> &out, const test_entry_t &entry, uint8_t flag, uint16_t path_len) {
+    uint16_t nm_len = entry.name.size() * 2;
+
+    ms_dir_fixed_t d1 = {};
+    d1.rec_len = sizeof(ms_dir_fixed_t) + sizeof(ms_dir_fixed2_t) + 2 * nm_len;
+    d1.path_len = path_len;
+    d1.flag = flag;
+    d1.file_len = entry.data.size();
+    d1.c_datetime = entry.mtime;
+    d1.a_datetime = entry.mtime;
+    d1.m_datetime = entry.mtime;
+    d1.nm_len = nm_len;
+
+    ms_dir_fixed2_t d2 = {};
+    d2.nm_len = nm_len;
+
+    append_bytes(out, &d1, sizeof(d1));
+    append_bytes(out, entry.name.data(), nm_len);
+    append_bytes(out, &d2, sizeof(d2));
+    append_bytes(out, entry.name.data(), nm_len);
+}
+
+// Catalog order: each directory lists its children together, the last one flagged DIRLAST,
+// and the lists of subdirectories follow depth first.
+static void append_catalog_children(std::vector<uint8_t> &out, const test_entry_t &dir, size_t &last_entry) {
+    for (size_t i = 0; i < dir.children.size(); ++i) {
+        const auto &child = dir.children[i];
+        uint8_t flag = child.is_dir ? SUBDIR : 0;
+        if (child.is_dir && child.children.empty()) {
+            flag |= EMPTYDIR;
+        }
+        if (i == dir.children.size() - 1) {
+            flag |= DIRLAST;
+        }
+        last_entry = out.size();
+        append_dir_entry(out, child, flag, 0);
+    }
+
+    for (const auto &child : dir.children) {
+        if (child.is_dir && !child.children.empty()) {
+            append_catalog_children(out, child, last_entry);
+        }
+    }
+}
+
+static std::vector<uint8_t> make_catalog(const test_entry_t &root) {
+    std::vector<uint8_t> catalog;
+    size_t last_entry = 0;
+    append_dir_entry(catalog, root, SUBDIR | DIRLAST, 0);
+    append_catalog_children(catalog, root, last_entry);
+
+    // The last entry also ends the catalog.
+    ((ms_dir_fixed_t *) &catalog[last_entry])->flag |= DIREND;
+    return catalog;
+}
+
+// Data region records: DAT_SIG, the directory entry, the path of the parent directory, EDAT_SIG,
+// two bytes, then the file data.
+static void append_data_records(std::vector<uint8_t> &out, const test_entry_t &dir, const std::u16string &path) {
+    for (const auto &child : dir.children) {
+        uint32_t dat_sig = DAT_SIG, edat_sig = EDAT_SIG;
+        uint16_t pad = 0;
+
+        append_bytes(out, &dat_sig, sizeof(dat_sig));
+        append_dir_entry(out, child, child.is_dir ? SUBDIR : 0, path.size() * 2);
+        append_bytes(out, path.data(), path.size() * 2);
+        append_bytes(out, &edat_sig, sizeof(edat_sig));
+        append_bytes(out, &pad, sizeof(pad));
+        append_bytes(out, child.data.data(), child.data.size());
+
+        if (child.is_dir) {
+            append_data_records(out, child, path + u'\0' + child.name);
+        }
+    }
+}
+
+static std::vector<uint8_t> make_data_stream(const test_entry_t &root) {
+    std::vector<uint8_t> data;
+    append_data_records(data, root, u"");
+    return data;
+}
+
+// Lays out a whole archive: VTBL, MDID, the data region at 0x100, and the catalog in the last segments.
+static std::vector<uint8_t> make_test_archive(const test_entry_t &root, size_t chunk_size = 16 * 1024) {
+    auto data = make_data_stream(root);
+    auto catalog = make_catalog(root);
+
+    std::vector<uint8_t> archive(0x100);
+    auto vtbl = (qic_vtbl_t *) archive.data();
+    memcpy(vtbl->tag, VTBL_TAG, 4);
+    vtbl->dir_size = catalog.size();
+    vtbl->data_size = data.size();
+
+    const char mdid[] = "MDIDMediumID1234\xb0VR0100\xb0";
+    memcpy(&archive[sizeof(qic_vtbl_t)], mdid, sizeof(mdid));
+
+    auto region = make_data_region(data, chunk_size);
+    archive.insert(archive.end(), region.begin(), region.end());
+
+    auto catalog_start = archive.size();
+    for (size_t i = 0; i < catalog.size(); i += SEG_SZ / 2) {
+        auto size = std::min(SEG_SZ / 2, catalog.size() - i);
+        cseg_head_t seg_head = {i + size};
+        cframe_head_t frame_head = {uint16_t(size | RAW_SEG)};
+        append_bytes(archive, &seg_head, sizeof(seg_head));
+        append_bytes(archive, &frame_head, sizeof(frame_head));
+        append_bytes(archive, &catalog[i], size);
+    }
+
+    auto segments = (catalog.size() + SEG_SZ - 1) / SEG_SZ;
+    archive.resize(catalog_start + segments * SEG_SZ);
+    return archive;
+}
+
+// A small tree with nested, empty and non-ASCII named directories, and files spanning several segments.
+static test_entry_t make_test_tree() {
+    auto file = [](const char16_t *name, std::vector<uint8_t> data, uint32_t mtime) {
+        return test_entry_t{name, false, data, mtime, {}};
+    };
+    auto dir = [](const char16_t *name, std::vector<test_entry_t> children, uint32_t mtime) {
+        return test_entry_t{name, true, {}, mtime, children};
+    };
+    auto text = [](const char *s) { return std::vector<uint8_t>(s, s + strlen(s)); };
+
+    return dir(u"",
+               {
+                   dir(u"COMEXE",
+                       {
+                           dir(u"STUFF", {file(u"stuff.dat", make_sample_data(300000, 7), 900000000)}, 900000100),
+                           dir(u"LANGUAGE",
+                               {
+                                   dir(u"APL", {}, 900000200),
+                                   dir(u"C", {file(u"hello.c", text("int main() {}\n"), 900000300)}, 900000400),
+                                   dir(u"BASIC", {file(u"mortgage.bas", text("10 PRINT\r\n"), 900000500)},
+                                       900000600),
+                               },
+                               900000700),
+                       },
+                       900000800),
+                   file(u"config.sys", text("DEVICE=HIMEM.SYS\r\n"), 900000900),
+                   dir(u"TEXT",
+                       {
+                           file(u"readme.txt", make_sample_data(50000, 8, true), 900001000),
+                           file(u"caf\u00e9 \u65e5\u672c.txt", text("non-ASCII name"), 900001100),
+                       },
+                       900001200),
+               },
+               900001300);
+}
+
+// Maps a copy of data from a temporary file.
+static std::shared_ptr<MappedFile> map_temp_file(const std::vector<uint8_t> &data) {
+    char path[] = "/tmp/qic-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t) data.size();
+    close(fd);
+    auto file = ok ? MappedFile::create(path) : nullptr;
+    unlink(path);
+    return file;
+}
+
+#endif
@@ -0,0 +1,200 @@
+///
+/// Copyright (C) 2024 Vitaly Chipounov
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to deal
+/// in the Software without restriction, including without limitation the rights
+/// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+/// copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in all
+/// copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+/// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+/// SOFTWARE.
+///
+
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "log_prefix.h"
+
+// Work-stealing thread pool. Each worker has its own task queue, takes work from its front, and steals from the
+// back of the other queues when it runs dry. Threads waiting for a batch of tasks run queued tasks meanwhile,
+// so that tasks may themselves submit and wait for other tasks.
+class ThreadPool {
+    using task_t = std::function<void()>;
+
+    struct queued_task_t {
+        task_t run;
+        const char *log_prefix;
+    };
+
+    struct queue_t {
+        std::mutex lock;
+        std::deque<queued_task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<queue_t>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::atomic<size_t> m_pending;
+    std::atomic<size_t> m_next_queue;
+    bool m_stop;
+
+    // Index of the queue owned by the current thread, if it is a worker of this pool.
+    static inline thread_local const ThreadPool *t_pool = nullptr;
+    static inline thread_local size_t t_queue = 0;
+
+    ThreadPool(unsigned thread_count) : m_pending(0), m_next_queue(0), m_stop(false) {
+        for (unsigned i = 0; i < thread_count; ++i) {
+            m_queues.push_back(std::make_unique<queue_t>());
+        }
+
+        for (unsigned i = 0; i < thread_count; ++i) {
+            m_threads.emplace_back([this, i] { worker(i); });
+        }
+    }
+
+    bool pop(size_t index, bool front, queued_task_t &task) {
+        auto &queue = *m_queues[index];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+
+        if (front) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+
+        --m_pending;
+        return true;
+    }
+
+    // Runs one queued task, preferably from the queue of the current thread.
+    bool run_one() {
+        queued_task_t task;
+        bool own = t_pool == this;
+        auto first = own ? t_queue : 0;
+
+        if (!(own && pop(first, true, task))) {
+            bool found = false;
+            for (size_t i = 0; i < m_queues.size() && !found; ++i) {
+                auto index = (first + i) % m_queues.size();
+                found = (!own || index != first) && pop(index, false, task);
+            }
+
+            if (!found) {
+                return false;
+            }
+        }
+
+        auto log_prefix = t_log_prefix;
+        t_log_prefix = task.log_prefix;
+        task.run();
+        t_log_prefix = log_prefix;
+        return true;
+    }
+
+    void worker(size_t index) {
+        t_pool = this;
+        t_queue = index;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_cv.wait(lock, [this] { return m_stop || m_pending > 0; });
+                if (m_stop) {
+                    return;
+                }
+            }
+
+            run_one();
+        }
+    }
+
+public:
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+
+        for (auto &thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    static std::shared_ptr<ThreadPool> create(unsigned thread_count) {
+        if (thread_count == 0) {
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        }
+        return std::shared_ptr<ThreadPool>(new ThreadPool(thread_count));
+    }
+
+    unsigned size() const {
+        return m_threads.size();
+    }
+
+    void submit(task_t task) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            ++m_pending;
+        }
+
+        // Workers push their own subtasks to the front so that they run them first, while they are hot.
+        bool own = t_pool == this;
+        auto &queue = *m_queues[own ? t_queue : m_next_queue++ % m_queues.size()];
+        {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (own) {
+                queue.tasks.push_front({std::move(task), t_log_prefix});
+            } else {
+                queue.tasks.push_back({std::move(task), t_log_prefix});
+            }
+        }
+        m_cv.notify_one();
+    }
+
+    // Calls func(i) for each i in [0, count) on the pool and returns once all calls are done.
+    template <typename F> void parallel_for(size_t count, F func) {
+        std::atomic<size_t> remaining(count);
+        for (size_t i = 0; i < count; ++i) {
+            submit([&remaining, &func, i] {
+                func(i);
+                --remaining;
+            });
+        }
+
+        while (remaining > 0) {
+            if (!run_one()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    }
+};
+
+#endif
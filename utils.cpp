@@ -21,135 +21,308 @@
 ///
 
 #include <algorithm>
+#include <array>
+#include <errno.h>
 #include <filesystem>
 #include <functional>
 #include <inttypes.h>
 #include <iostream>
+#include <string.h>
 #include <string>
-#include <utime.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "main.h"
+#include "log_prefix.h"
 
 namespace fs = std::filesystem;
 
+// Writer threads may create the same directories at once, one that appears in the meantime is not an error.
 bool create_dir_tree(const fs::path &dir_path) {
     if (dir_path.empty()) {
         return false;
     }
 
-    if (fs::exists(dir_path)) {
+    std::error_code ec;
+    if (fs::is_directory(dir_path, ec)) {
         return true;
     }
 
-    std::error_code ec;
-    if (!fs::create_directories(dir_path, ec)) {
-        if (ec) {
-            std::cerr << "Error creating directory tree: " << ec.message() << std::endl;
+    fs::path current;
+    for (const auto &part : dir_path) {
+        current /= part;
+        if (mkdir(current.c_str(), 0777) < 0 && errno != EEXIST) {
+            std::cerr << t_log_prefix << "Error creating directory tree: " << strerror(errno) << std::endl;
             return false;
         }
     }
 
+    if (!fs::is_directory(dir_path, ec)) {
+        std::cerr << t_log_prefix << "Error creating directory tree: " << dir_path << " is not a directory"
+                  << std::endl;
+        return false;
+    }
+
     return true;
 }
 
-std::vector<size_t> search_binary_substring(const uint8_t *haystack, size_t haystack_size, const uint8_t *needle,
-                                            size_t needle_size) {
-    std::vector<size_t> occurrences;
-    if (needle_size == 0 || haystack_size < needle_size) {
-        return occurrences;
+ssize_t utf16_to_utf8(const void *buffer, size_t size_in_bytes, char *out) {
+    if (size_in_bytes % 2 != 0) {
+        return -1;
     }
 
-    auto searcher = std::boyer_moore_searcher(needle, needle + needle_size);
-    const uint8_t *end = haystack + haystack_size;
+    auto in = static_cast<const uint8_t *>(buffer);
+    auto count = size_in_bytes / 2;
+    auto start = out;
 
-    auto it = haystack;
-    while (it != end) {
-        it = std::search(it, end, searcher);
-        if (it != end) {
-            occurrences.push_back(it - haystack);
-            ++it;
+    for (size_t i = 0; i < count; ++i) {
+#ifdef __SSE2__
+        // Almost all names are ASCII, runs of it narrow 8 code units at a time.
+        for (; i + 8 <= count; i += 8, out += 8) {
+            auto units = _mm_loadu_si128((const __m128i *) (in + i * 2));
+            auto high = _mm_and_si128(units, _mm_set1_epi16((short) 0xff80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff) {
+                break;
+            }
+            _mm_storel_epi64((__m128i *) out, _mm_packus_epi16(units, units));
+        }
+        if (i == count) {
+            break;
+        }
+#endif
+
+        uint32_t c = in[i * 2] | in[i * 2 + 1] << 8;
+        if (c < 0x80) {
+            *out++ = c;
+        } else if (c < 0x800) {
+            *out++ = 0xc0 | c >> 6;
+            *out++ = 0x80 | (c & 0x3f);
+        } else if (c < 0xd800 || c > 0xdfff) {
+            *out++ = 0xe0 | c >> 12;
+            *out++ = 0x80 | ((c >> 6) & 0x3f);
+            *out++ = 0x80 | (c & 0x3f);
+        } else if (c < 0xdc00) {
+            // Like std::codecvt_utf8_utf16, a high surrogate at the end is dropped, one without a low surrogate
+            // after it makes the whole name invalid.
+            if (i + 1 == count) {
+                break;
+            }
+
+            uint32_t low = in[i * 2 + 2] | in[i * 2 + 3] << 8;
+            if (low < 0xdc00 || low > 0xdfff) {
+                return -1;
+            }
+
+            c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+            *out++ = 0xf0 | c >> 18;
+            *out++ = 0x80 | ((c >> 12) & 0x3f);
+            *out++ = 0x80 | ((c >> 6) & 0x3f);
+            *out++ = 0x80 | (c & 0x3f);
+            ++i;
+        } else {
+            return -1;
         }
     }
 
-    return occurrences;
+    return out - start;
 }
 
-std::string utf16_to_utf8(const void *buffer, size_t size_in_bytes) {
-    if (size_in_bytes % 2 != 0) {
-        return "";
-    }
+std::string_view utf16_to_utf8(const void *buffer, size_t size_in_bytes, StringArena &arena) {
+    auto size = utf16_to_utf8(buffer, size_in_bytes, arena.alloc(size_in_bytes / 2 * 3));
+    return arena.commit(size < 0 ? 0 : size);
+}
 
-    auto utf16_string = static_cast<const char16_t *>(buffer);
-    size_t utf16_length = size_in_bytes / 2;
+struct month_day_t {
+    uint8_t mon;
+    uint8_t mday;
+};
 
-    try {
-        std::u16string utf16_str(utf16_string, utf16_length);
-        std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> convert;
-        std::string utf8_str = convert.to_bytes(utf16_str);
-        return utf8_str;
-    } catch (...) {
-        return "";
+// Month and day of the month of the days of a year, leap or not, as found by walking through the months of the
+// original conversion: September has 31 days and October 30, and day 0 falls on January 0.
+static constexpr std::array<std::array<month_day_t, 367>, 2> make_month_table() {
+    std::array<std::array<month_day_t, 367>, 2> table = {};
+    for (unsigned leap = 0; leap < 2; ++leap) {
+        uint8_t mondays[] = {31, uint8_t(28 + leap), 31, 30, 31, 30, 31, 31, 31, 30, 31, 31};
+        for (unsigned day = 0; day < 367; ++day) {
+            unsigned mon = 0, mday = day;
+            while (mon < 12 && mondays[mon] < mday) {
+                mday -= mondays[mon++];
+            }
+            table[leap][day] = {uint8_t(mon), uint8_t(mday)};
+        }
     }
+    return table;
 }
 
-static const uint16_t BASEYR = 1970;
+static constexpr auto MONTH_TABLE = make_month_table();
 
-struct tm get_time(unsigned long date) {
-    struct tm ret = {0};
-    uint8_t mondays[] = {31, 28, 31, 30, 31, 30, 31, 31, 31, 30, 31, 31};
-    uint16_t yr = BASEYR, mon = 0, day, hour, min, sec;
-    char lpyr;
-    sec = date % 60;
+// Leap years as the original conversion has them, every fourth one except centuries, 2000 included.
+static bool is_qic_leap_year(long year) {
+    return year % 4 == 0 && year % 100 != 0;
+}
+
+// Days before January 1st of the year since 1970, with the leap years above.
+static long get_qic_days_before(long year) {
+    return 365 * (year - 1970) + (year - 1) / 4 - (year - 1) / 100 - (1969 / 4 - 1969 / 100);
+}
+
+// Days since 1970-01-01 of a date of the proleptic Gregorian calendar, month being 1 to 12.
+static long get_days_from_civil(long year, unsigned mon, unsigned mday) {
+    year -= mon <= 2;
+    auto era = year / 400;
+    unsigned yoe = year - era * 400;
+    unsigned doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + mday - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + long(doe) - 719468;
+}
+
+// The result of the original conversion, which walked through the years and months to fill a struct tm for mktime.
+// Its quirks are kept so that extracted files get the same times as before: the month was one past the right one
+// and the days counted from 1, both normalized by mktime, year 2000 is not a leap year, and the walk through the
+// years checked the remaining days against the length of the year before, whose February it then used. That also
+// stops it a year early at the start of the second year after a leap year.
+time_t get_time(unsigned long date, long seconds_west) {
+    auto sec = date % 60;
     date /= 60;
-    min = date % 60;
+    auto min = date % 60;
     date /= 60;
-    hour = date % 24;
-    date /= 24;
-    do {
-        if ((yr % 100) == 0 || (yr % 4) != 0) {
-            day = 365; // not a leap year
-            lpyr = 0;
-        } else {
-            day = 366; // is a leap year
-            lpyr = 1;
-        }
-        if (date > day) {
-            yr++;
-            date -= day;
+    auto hour = date % 24;
+    long days = date / 24;
+
+    long year = 1970, day = days;
+    bool leap = false;
+    if (days > 365) {
+        // Each year having at most 366 days, this is at most two years early.
+        year += (days - 1) / 366;
+        while (get_qic_days_before(year + 1) < days) {
+            ++year;
         }
-    } while (date > day);
-    day = date;
 
-    mondays[1] += lpyr;
-    while (mon < 12) {
-        if (mondays[mon] >= day) {
-            break;
-        } else {
-            day -= mondays[mon++];
+        day = days - get_qic_days_before(year);
+        if (day == 1 && is_qic_leap_year(year - 2)) {
+            --year;
+            day = 366;
         }
+        leap = day == 366 || is_qic_leap_year(year - 1);
     }
-    mondays[1] -= lpyr;
 
-    ret.tm_mday = day;
-    ret.tm_mon = mon + 1;
-    ret.tm_year = yr - 1900;
-    ret.tm_hour = hour;
-    ret.tm_min = min;
-    ret.tm_sec = sec;
+    auto md = MONTH_TABLE[leap][day];
+    unsigned mon = md.mon + 1;
+    auto civil_days = get_days_from_civil(year + mon / 12, mon % 12 + 1, 1) + md.mday - 1;
+    return civil_days * 86400 + hour * 3600 + min * 60 + sec + seconds_west;
+}
+
+// Days of 32-bit QIC times, and the month the conversion may add.
+static const long LOCAL_OFFSET_DAYS = UINT32_MAX / 86400 + 32;
+
+// Days not looked up yet, and days during which the offset changes.
+static const int64_t OFFSET_UNKNOWN = INT64_MIN;
+static const int64_t OFFSET_VARIES = INT64_MAX;
+
+// mktime was given the time as local standard time, tm_isdst being 0.
+static long get_mktime_offset(time_t local) {
+    struct tm tm;
+    gmtime_r(&local, &tm);
+    tm.tm_isdst = 0;
+    return mktime(&tm) - local;
+}
 
-    return ret;
+LocalOffsets::LocalOffsets() : m_offsets(new std::atomic<int64_t>[LOCAL_OFFSET_DAYS]) {
+    for (long day = 0; day < LOCAL_OFFSET_DAYS; ++day) {
+        m_offsets[day].store(OFFSET_UNKNOWN, std::memory_order_relaxed);
+    }
 }
 
-bool update_timestamps(const char *filepath, const struct tm *mtime, const struct tm *atime) {
-    struct utimbuf new_times = {0};
+long LocalOffsets::get(time_t local) {
+    auto day = local / 86400;
+    if (local < 0 || day >= LOCAL_OFFSET_DAYS) {
+        return get_mktime_offset(local);
+    }
 
-    auto m = *mtime;
-    auto a = *atime;
-    new_times.actime = mktime(&a);
-    new_times.modtime = mktime(&m);
-    if (utime(filepath, &new_times) < 0) {
-        return false;
+    // The offset holds for the whole day when it is the same at both ends.
+    auto offset = m_offsets[day].load(std::memory_order_relaxed);
+    if (offset == OFFSET_UNKNOWN) {
+        auto first = get_mktime_offset(day * 86400);
+        auto last = get_mktime_offset(day * 86400 + 86399);
+        offset = first == last ? first : OFFSET_VARIES;
+        m_offsets[day].store(offset, std::memory_order_relaxed);
+    }
+
+    return offset == OFFSET_VARIES ? get_mktime_offset(local) : offset;
+}
+
+time_t get_time(unsigned long date, LocalOffsets &offsets) {
+    auto local = get_time(date, 0);
+    return local + offsets.get(local);
+}
+
+time_t get_time(unsigned long date) {
+    static LocalOffsets offsets;
+    return get_time(date, offsets);
+}
+
+bool update_timestamps(const char *filepath, time_t mtime, time_t atime) {
+    return update_timestamps(AT_FDCWD, filepath, mtime, atime);
+}
+
+bool update_timestamps(int fd, time_t mtime, time_t atime) {
+    struct timespec times[2] = {{atime, 0}, {mtime, 0}};
+    return futimens(fd, times) == 0;
+}
+
+bool update_timestamps(int dir_fd, const char *name, time_t mtime, time_t atime) {
+    struct timespec times[2] = {{atime, 0}, {mtime, 0}};
+    return utimensat(dir_fd, name, times, 0) == 0;
+}
+
+bool copy_extents(const MappedFile *archive, const std::vector<file_extent_t> &extents, int fd) {
+    // copy_file_range does not work across all file systems and sendfile not into all files, fall back to writing
+    // from the mapping once either refuses.
+    bool use_copy_file_range = true;
+    bool use_sendfile = true;
+
+    for (const auto &extent : extents) {
+        off_t offset = extent.offset;
+        auto end = extent.offset + extent.size;
+        while ((size_t) offset < end) {
+            auto left = end - offset;
+            ssize_t ret;
+            if (use_copy_file_range) {
+                ret = copy_file_range(archive->fd(), &offset, fd, nullptr, left, 0);
+                if (ret < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                    use_copy_file_range = false;
+                    continue;
+                }
+            } else if (use_sendfile) {
+                ret = sendfile(fd, archive->fd(), &offset, left);
+                if (ret < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                    use_sendfile = false;
+                    continue;
+                }
+            } else {
+                auto data = archive->get(offset, left);
+                if (!data) {
+                    return false;
+                }
+                ret = write(fd, data, left);
+                offset += ret > 0 ? ret : 0;
+            }
+
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                return false;
+            }
+        }
     }
 
     return true;